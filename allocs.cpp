@@ -0,0 +1,178 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// counts the heap allocations of steady state training steps on every
+// training path. the malloc family is replaced by counting wrappers, which
+// operator new, eigen and the standard containers all end up in. an epoch
+// over 2 * STEPS batches is compared with one over STEPS batches, so the
+// fixed cost of an epoch (its threads and staging buffers) cancels out and
+// what is left is the allocations of STEPS training steps:
+//   ./allocs
+// exits with 1 if a path that is meant to be allocation free allocates
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <atomic>
+#include <cstdlib>
+#include "trainer.h"
+#include "network.h"
+#include "train.h"
+#include "dataset.h"
+#include "pipeline.h"
+
+extern "C" {
+void *__libc_malloc(size_t n);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t n);
+void *__libc_memalign(size_t align, size_t n);
+}
+
+static std::atomic<size_t> allocations(0);
+
+extern "C" void *malloc(size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(p, n);
+}
+
+extern "C" void *memalign(size_t align, size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(align, n);
+}
+
+extern "C" void *aligned_alloc(size_t align, size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(align, n);
+}
+
+extern "C" int posix_memalign(void **p, size_t align, size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    *p = __libc_memalign(align, n);
+    return *p ? 0 : ENOMEM;
+}
+
+#define STEPS 20
+#define BATCH 50
+
+// allocations of one epoch over the first batches * BATCH records of data
+template<typename T>
+size_t epoch_allocations(parallel_trainer<T> &pt, const dataset &data, size_t batches, int mode, bool sparse)
+{
+    dataset part;
+    part.view(data.labels(), data.pixels(0), batches * BATCH);
+    batch_source source(part, BATCH, true, 1);
+    source.setSparse(sparse);
+    source.epoch(0);
+    size_t before = allocations.load();
+    pt.epoch(source, mode, [](size_t) {});
+    return allocations.load() - before;
+}
+
+// allocations of STEPS steady state steps of tr in mode, after a warm up
+// epoch that sizes every workspace
+template<typename T>
+size_t step_allocations(T &tr, const dataset &data, int mode, int threads, bool sparse)
+{
+    parallel_trainer<T> pt(tr, mode == TRAIN_SERIAL ? 1 : threads);
+    epoch_allocations(pt, data, 2 * STEPS, mode, sparse);
+    size_t once = epoch_allocations(pt, data, STEPS, mode, sparse);
+    size_t twice = epoch_allocations(pt, data, 2 * STEPS, mode, sparse);
+    return twice > once ? twice - once : 0;
+}
+
+// prints the allocations of every mode of tr, returns the number of
+// paths that allocated. a mode tr trains in another one, hogwild in the
+// half precisions, is the path already counted and only noted
+template<typename T>
+int check(const std::string &name, T &tr, const dataset &data, int threads, bool strict)
+{
+    int failed = 0;
+    for (int mode : { TRAIN_SERIAL, TRAIN_SYNC, TRAIN_HOGWILD }) {
+        int runs = effective_train_mode(mode, tr.precision());
+        if (runs != mode) {
+            std::cout << std::left << std::setw(14) << name << std::setw(9) << train_mode_name(mode) << std::right
+                      << "runs as " << train_mode_name(runs) << ", skipped" << std::endl;
+            continue;
+        }
+        for (bool sparse : { false, true }) {
+            size_t n = step_allocations(tr, data, mode, threads, sparse);
+            std::cout << std::left << std::setw(14) << name << std::setw(9) << train_mode_name(mode)
+                      << std::setw(8) << (sparse ? "sparse" : "dense") << std::right
+                      << n << " allocations in " << STEPS << " steps"
+                      << (n && !strict ? " (expected)" : "") << std::endl;
+            failed += n && strict;
+        }
+    }
+    return failed;
+}
+
+int main()
+{
+    const size_t Records = 2 * STEPS * BATCH;
+    std::mt19937 rng(1);
+    std::vector<unsigned char> labels(Records), pixels(Records * dataset::PIXELS);
+    for (size_t i = 0; i < Records; ++i) {
+        labels[i] = rng() % 10;
+        for (int t = 0; t < dataset::PIXELS; ++t) {
+            pixels[i * dataset::PIXELS + t] = rng() % 5 == 0 ? rng() % 256 : 0;
+        }
+    }
+    dataset data;
+    data.view(labels.data(), pixels.data(), Records);
+    int threads = thread_pool::hardware() < 2 ? 2 : thread_pool::hardware();
+
+    // the fixed size trainer is allocation free on every path and in every
+    // precision, the runtime sized products of layer_network allocate their
+    // gemm buffers
+    int failed = 0;
+    trainer<784, 225, 10> tr(0.01f);
+    failed += check("fixed", tr, data, threads, true);
+    for (int prec : { PREC_BF16, PREC_FP16 }) {
+        tr.setPrecision(prec);
+        failed += check(std::string("fixed_") + precision_name(prec), tr, data, threads, true);
+    }
+    tr.setPrecision(PREC_FP32);
+    layer_network ln(std::vector<int>{784, 256, 128, 10}, 0.01f);
+    failed += check("dynamic", ln, data, threads, false);
+    if (failed) {
+        std::cout << failed << " allocating path(s)" << std::endl;
+        return 1;
+    }
+    std::cout << "no allocations in steady state" << std::endl;
+    return 0;
+}
@@ -0,0 +1,262 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_AUTOTUNE_H
+#define MNIST_AUTOTUNE_H
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include "dataset.h"
+#include "pipeline.h"
+#include "network.h"
+#include "evaluate.h"
+#include "train.h"
+#include "thread_pool.h"
+
+// how the train command steps through the data
+struct train_config
+{
+    std::string layers;
+    int batch;
+    int threads;
+    float rate;
+};
+
+// text file of key=value lines
+inline int save_config(const char *path, const train_config &c)
+{
+    std::ofstream ofs(path);
+    if (!ofs) {
+        return -1;
+    }
+    ofs << "layers=" << c.layers << std::endl;
+    ofs << "batch=" << c.batch << std::endl;
+    ofs << "threads=" << c.threads << std::endl;
+    ofs << "rate=" << c.rate << std::endl;
+    return ofs ? 0 : -1;
+}
+
+inline int load_config(const char *path, train_config &c)
+{
+    std::ifstream ifs(path);
+    if (!ifs) {
+        return -1;
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        std::string key = line.substr(0, eq), value = line.substr(eq + 1);
+        if (key == "layers") {
+            c.layers = value;
+        } else if (key == "batch") {
+            c.batch = atoi(value.c_str());
+        } else if (key == "threads") {
+            c.threads = atoi(value.c_str());
+        } else if (key == "rate") {
+            c.rate = atof(value.c_str());
+        }
+    }
+    return c.batch > 0 && c.threads > 0 && c.rate > 0 ? 0 : -1;
+}
+
+// one timed trial of the autotuner
+struct tune_result
+{
+    int batch;
+    int threads;
+    float rate;
+    double samples;
+    double progress;
+    double loss;
+    double accuracy;
+};
+
+// runs short timed trials of the train step over batch sizes, thread
+// counts and rates, every one from the same starting weights. a trial is
+// scored by samples/s and by how fast it lowers the squared error of a
+// sample of records held out of training, the last tenth of the data up
+// to SAMPLE records. the update is rate times the gradient summed
+// over the batch, so each batch size is tried with the rate as is, scaled
+// by sqrt(BASE_BATCH / batch), and by BASE_BATCH / batch which keeps the
+// step per record of BASE_BATCH. the best trial is the
+// one lowering the error the fastest while scoring no worse than
+// TOLERANCE below the BASE_BATCH serial trial. the weights and the rate
+// are put back when done
+template<typename T>
+class autotuner
+{
+public:
+    enum { BASE_BATCH = 50, SAMPLE = 2000 };
+    static constexpr double TOLERANCE = 0.005;
+
+    autotuner(T &tr, const dataset &data, bool sparse, double budget) : tr(tr), sparse(sparse), budget(budget), best(0) {
+        size_t held = data.size() / 10 < size_t(SAMPLE) ? data.size() / 10 : size_t(SAMPLE);
+        size_t trained = data.size() - held;
+        train.view(data.labels(), data.pixels(0), trained);
+        sample.view(data.labels() + trained, data.pixels(trained), held);
+    }
+
+    void run() {
+        static const int batches[] = {10, 25, 50, 100, 200, 500};
+        std::vector<int> threads;
+        for (int n = 1; n < thread_pool::hardware(); n *= 2) {
+            threads.push_back(n);
+        }
+        threads.push_back(thread_pool::hardware());
+        float rate = tr.rate();
+        std::vector<float> initial(tr.parameters());
+        tr.snapshot(initial.data());
+        loss(base, base_accuracy);
+        results.clear();
+        size_t baseline = 0;
+        for (int b : batches) {
+            for (int n : threads) {
+                if (n > b) {
+                    continue;
+                }
+                if (b == BASE_BATCH && n == 1) {
+                    baseline = results.size();
+                }
+                trial(b, n, rate, initial);
+                if (b != BASE_BATCH) {
+                    trial(b, n, rate * std::sqrt(float(BASE_BATCH) / b), initial);
+                    trial(b, n, rate * BASE_BATCH / b, initial);
+                }
+            }
+        }
+        tr.restore(initial.data());
+        tr.setRate(rate);
+        // the baseline passes its own accuracy check, so the search starts
+        // from it
+        best = baseline;
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (results[i].accuracy >= results[baseline].accuracy - TOLERANCE && results[i].progress > results[best].progress) {
+                best = i;
+            }
+        }
+    }
+
+    const std::vector<tune_result> &trials() const {
+        return results;
+    }
+
+    const tune_result &chosen() const {
+        return results[best];
+    }
+
+    void print(std::ostream &os) const {
+        os << "error of the sample before: " << base << ", accuracy " << base_accuracy << std::endl;
+        os << std::setw(6) << "batch" << std::setw(8) << "threads" << std::setw(10) << "rate" << std::setw(12) << "samples/s"
+           << std::setw(12) << "error" << std::setw(12) << "error/s" << std::setw(10) << "accuracy" << std::endl;
+        for (size_t i = 0; i < results.size(); ++i) {
+            const tune_result &r = results[i];
+            os << std::setw(6) << r.batch << std::setw(8) << r.threads << std::setw(10) << r.rate << std::setw(12) << r.samples
+               << std::setw(12) << r.loss << std::setw(12) << r.progress << std::setw(10) << r.accuracy << (i == best ? " *" : "") << std::endl;
+        }
+    }
+
+protected:
+    // train from initial with one configuration for the budget, whole
+    // epochs or not
+    void trial(int b, int n, float rate, const std::vector<float> &initial) {
+        tr.restore(initial.data());
+        tr.setRate(rate);
+        batch_source source(train, b, true);
+        source.setSparse(sparse);
+        parallel_trainer<T> ptr(tr, n);
+        size_t trained = 0;
+        auto bt = std::chrono::steady_clock::now();
+        double secs = 0;
+        for (int lp = 0; secs < budget; ++lp) {
+            source.epoch(lp);
+            prefetcher pf(source);
+            while (batch *pb = pf.next()) {
+                if (n > 1 && sparse) {
+                    ptr.trainSync(pb->sparse, pb->targets);
+                } else if (n > 1) {
+                    ptr.trainSync(pb->inputs, pb->targets);
+                } else if (sparse) {
+                    tr.train(pb->sparse, pb->targets);
+                } else {
+                    tr.train(pb->inputs, pb->targets);
+                }
+                trained += pb->targets.rows();
+                secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+                if (secs >= budget) {
+                    break;
+                }
+            }
+        }
+        tune_result r;
+        r.batch = b;
+        r.threads = n;
+        r.rate = rate;
+        r.samples = trained / secs;
+        loss(r.loss, r.accuracy);
+        r.progress = (base - r.loss) / secs;
+        results.push_back(r);
+    }
+
+    // mean squared error and accuracy of the current weights on the sample
+    void loss(double &err, double &accuracy) {
+        Matrix<float, Dynamic, 784, RowMajor> m;
+        Matrix<float, Dynamic, 10> o;
+        double sum = 0;
+        size_t correct = 0;
+        for (size_t b = 0; b < sample.size(); b += 256) {
+            int n = sample.size() - b < 256 ? sample.size() - b : 256;
+            score_records(tr, sample, b, n, m, o);
+            for (int i = 0; i < n; ++i) {
+                int label = sample.label(b + i), pi;
+                o.row(i).maxCoeff(&pi);
+                for (int j = 0; j < 10; ++j) {
+                    double e = (j == label ? 1.0 : 0.0) - o(i, j);
+                    sum += e * e;
+                }
+                if (pi == label) {
+                    ++correct;
+                }
+            }
+        }
+        err = sample.size() ? sum / sample.size() : 0;
+        accuracy = sample.size() ? double(correct) / sample.size() : 0;
+    }
+
+    T &tr;
+    dataset train;
+    dataset sample;
+    bool sparse;
+    double budget;
+    double base;
+    double base_accuracy;
+    std::vector<tune_result> results;
+    size_t best;
+};
+
+#endif
@@ -0,0 +1,350 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+// micro benchmarks of the hot paths on synthetic data, every case is run
+// a few times to warm up, then timed rep by rep, and the percentiles of
+// the rep times are printed and written as json:
+//   ./bench [<json_path>] [<reps>]
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <unistd.h>
+#include "trainer.h"
+#include "network.h"
+#include "dataset.h"
+#include "pipeline.h"
+#include "quantize.h"
+#include "kernels.h"
+#include "half.h"
+#include "dispatch.h"
+
+struct result
+{
+    std::string name;
+    std::string unit;
+    double items;
+    std::vector<double> times;
+
+    double percentile(double p) const {
+        std::vector<double> v(times);
+        std::sort(v.begin(), v.end());
+        size_t i = size_t(p * (v.size() - 1) + 0.5);
+        return v[i];
+    }
+
+    double mean() const {
+        double s = 0;
+        for (auto t : times) {
+            s += t;
+        }
+        return s / times.size();
+    }
+
+    // items per second at the median time
+    double rate() const {
+        return items / percentile(0.5);
+    }
+};
+
+// time reps calls of f after warmup calls, items is the work of one call
+// in unit, for the throughput
+result measure(const std::string &name, const std::string &unit, double items, int warmup, int reps, const std::function<void()> &f)
+{
+    result r;
+    r.name = name;
+    r.unit = unit;
+    r.items = items;
+    for (int i = 0; i < warmup; ++i) {
+        f();
+    }
+    for (int i = 0; i < reps; ++i) {
+        auto bt = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - bt;
+        r.times.push_back(elapsed_seconds.count());
+    }
+    std::cout << std::left << std::setw(28) << name << std::right
+              << " p50 " << std::setw(10) << r.percentile(0.5) * 1e6 << "us"
+              << " p90 " << std::setw(10) << r.percentile(0.9) * 1e6 << "us"
+              << " p99 " << std::setw(10) << r.percentile(0.99) * 1e6 << "us"
+              << "  " << r.rate() << " " << unit << "/s" << std::endl;
+    return r;
+}
+
+// mnist like csv: every digit class lights a fixed random stroke set, a
+// record keeps part of its strokes and gets some noise, about a fifth of
+// the pixels are nonzero like in mnist
+std::string synthetic_csv(size_t count, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<std::vector<int>> strokes(10);
+    for (auto &s : strokes) {
+        for (int i = 0; i < 160; ++i) {
+            s.push_back(rng() % 784);
+        }
+    }
+    std::ostringstream os;
+    unsigned char px[784];
+    for (size_t n = 0; n < count; ++n) {
+        int label = rng() % 10;
+        memset(px, 0, sizeof(px));
+        for (int p : strokes[label]) {
+            if (rng() % 10 < 4) {
+                px[p] = 100 + rng() % 156;
+            }
+        }
+        for (int i = 0; i < 100; ++i) {
+            px[rng() % 784] = rng() % 256;
+        }
+        os << label;
+        for (int i = 0; i < 784; ++i) {
+            os << ',' << int(px[i]);
+        }
+        os << '\n';
+    }
+    return os.str();
+}
+
+int write_json(const char *path, const std::vector<result> &results)
+{
+    std::ofstream os(path, std::ios::out);
+    if (!os.is_open()) {
+        std::cout << "cannot open: " << path << std::endl;
+        return -1;
+    }
+#ifdef EIGEN_USE_MKL_ALL
+    const char *build = "mkl";
+#else
+    const char *build = "eigen";
+#endif
+    os << "{\n  \"build\": \"" << build << "\",\n  \"compiler\": \"" << __VERSION__
+       << "\",\n  \"isa\": \"" << isa_name(compiled_isa())
+       << "\",\n  \"int8_kernel\": \"" << int8_kernel_name() << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const result &r = results[i];
+        os << "    {\"name\": \"" << r.name << "\", \"reps\": " << r.times.size()
+           << ", \"min_us\": " << r.percentile(0) * 1e6
+           << ", \"mean_us\": " << r.mean() * 1e6
+           << ", \"p50_us\": " << r.percentile(0.5) * 1e6
+           << ", \"p90_us\": " << r.percentile(0.9) * 1e6
+           << ", \"p99_us\": " << r.percentile(0.99) * 1e6
+           << ", \"max_us\": " << r.percentile(1) * 1e6
+           << ", \"rate\": " << r.rate() << ", \"unit\": \"" << r.unit << "/s\"}"
+           << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    os << "  ]\n}\n";
+    return os ? 0 : -1;
+}
+
+// make builds this file once per isa level, see dispatch.h
+#ifdef MNIST_ISA
+extern "C" int ISA_MAIN(bench, MNIST_ISA)(int argc, char *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+    const char *json = argc > 1 ? argv[1] : "bench.json";
+    int reps = argc > 2 ? atoi(argv[2]) : 50;
+    if (reps <= 0) {
+        reps = 50;
+    }
+    std::vector<result> results;
+
+    // parsing and loading
+    const size_t Records = 10000;
+    std::string csv = synthetic_csv(Records, 1);
+    std::string line = csv.substr(0, csv.find('\n'));
+    double mb = csv.size() / 1e6;
+    unsigned char px[784];
+    results.push_back(measure("parse_line", "MB", line.size() / 1e6 * 1000, 10, reps, [&]() {
+        for (int i = 0; i < 1000; ++i) {
+            parse_line(line.c_str(), line.size(), px);
+        }
+    }));
+    char tmp[] = "/tmp/mnist_bench_XXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd < 0 || write(fd, csv.data(), csv.size()) != ssize_t(csv.size())) {
+        std::cout << "cannot write: " << tmp << std::endl;
+        return -1;
+    }
+    close(fd);
+    std::string cache = std::string(tmp) + ".bin";
+    dataset data;
+    results.push_back(measure("load_csv", "MB", mb, 1, reps / 5 + 1, [&]() {
+        data.loadCsv(tmp);
+    }));
+    data.saveBinary(cache.c_str());
+    // the cache is mapped lazily, so every page is touched to count the
+    // faults in as well
+    size_t touched = 0;
+    results.push_back(measure("load_binary", "MB", mb, 1, reps, [&]() {
+        data.loadBinary(cache.c_str());
+        for (size_t i = 0; i < data.size(); i += 4096 / 784) {
+            touched += data.pixels(i)[0] + data.label(i);
+        }
+    }));
+    unlink(tmp);
+    unlink(cache.c_str());
+
+    // training steps, dense and sparse first layer
+    trainer<784, 225, 10> tr(0.01f);
+    for (int size : { 1, 10, 50, 100, 500 }) {
+        batch_source bs(data, size);
+        batch b;
+        bs.fill(0, b);
+        results.push_back(measure("train_dense_b" + std::to_string(size), "samples", size, 5, reps, [&]() {
+            tr.train(b.inputs, b.targets);
+        }));
+        bs.setSparse(true);
+        bs.fill(0, b);
+        results.push_back(measure("train_sparse_b" + std::to_string(size), "samples", size, 5, reps, [&]() {
+            tr.train(b.sparse, b.targets);
+        }));
+    }
+
+    // the same network with fixed and runtime sized kernels, and a deeper
+    // one that only runs with runtime sizes
+    layer_network ln(std::vector<int>{784, 225, 10}, 0.01f);
+    layer_network deep(std::vector<int>{784, 256, 128, 10}, 0.01f);
+    for (int size : { 50, 500 }) {
+        batch_source bs(data, size);
+        batch b;
+        bs.fill(0, b);
+        results.push_back(measure("train_dynamic_b" + std::to_string(size), "samples", size, 5, reps, [&]() {
+            ln.train(b.inputs, b.targets);
+        }));
+        results.push_back(measure("train_deep_b" + std::to_string(size), "samples", size, 5, reps, [&]() {
+            deep.train(b.inputs, b.targets);
+        }));
+    }
+
+    // scoring, float and int8
+    quantized_model<784, 225, 10> qm;
+    qm.quantize(tr, data);
+    for (int size : { 1, 256 }) {
+        Matrix<float, Dynamic, 784, RowMajor> m(size, 784);
+        Matrix<float, Dynamic, 10> o;
+        for (int i = 0; i < size; ++i) {
+            convert_pixels(data.pixels(i), m.row(i).data(), 784);
+        }
+        results.push_back(measure("predict_b" + std::to_string(size), "records", size, 5, reps, [&]() {
+            tr.predict(m, o);
+        }));
+        results.push_back(measure("predict_int8_b" + std::to_string(size), "records", size, 5, reps, [&]() {
+            qm.predict(data.pixels(0), size, o);
+        }));
+        results.push_back(measure("predict_dynamic_b" + std::to_string(size), "records", size, 5, reps, [&]() {
+            ln.predict(m, o);
+        }));
+    }
+
+    // weights stored in half and activations rounded to half, against the
+    // float steps above, and the conversion kernels over the first layer
+    // weights
+    for (int prec : { PREC_BF16, PREC_FP16 }) {
+        std::string name = precision_name(prec);
+        tr.setPrecision(prec);
+        for (int size : { 50, 500 }) {
+            batch_source bs(data, size);
+            batch b;
+            bs.fill(0, b);
+            results.push_back(measure("train_" + name + "_b" + std::to_string(size), "samples", size, 5, reps, [&]() {
+                tr.train(b.inputs, b.targets);
+            }));
+        }
+        Matrix<float, Dynamic, 784, RowMajor> m(256, 784);
+        Matrix<float, Dynamic, 10> o;
+        for (int i = 0; i < 256; ++i) {
+            convert_pixels(data.pixels(i), m.row(i).data(), 784);
+        }
+        results.push_back(measure("predict_" + name + "_b256", "records", 256, 5, reps, [&]() {
+            tr.predict(m, o);
+        }));
+        tr.setPrecision(PREC_FP32);
+        std::vector<float> w(tr.getIh().data(), tr.getIh().data() + tr.getIh().size()), r(w.size());
+        std::vector<uint16_t> hw(w.size());
+        results.push_back(measure("round_" + name, "values", w.size(), 5, reps, [&]() {
+            r = w;
+            round_half(r.data(), r.size(), prec);
+        }));
+        results.push_back(measure("to_" + name, "values", w.size(), 5, reps, [&]() {
+            to_half(w.data(), hw.data(), w.size(), prec);
+        }));
+        results.push_back(measure("from_" + name, "values", w.size(), 5, reps, [&]() {
+            from_half(hw.data(), r.data(), r.size(), prec);
+        }));
+    }
+
+    // activation kernels over a batch of hidden outputs
+    Matrix<float, Dynamic, 225> h = Matrix<float, Dynamic, 225>::Random(256, 225) * 8;
+    Matrix<float, Dynamic, 225> x;
+    for (int act : { ACT_EIGEN, ACT_SIMD, ACT_FAST }) {
+        tr.setActivation(act);
+        results.push_back(measure(std::string("sigmoid_") + activation_name(act), "values", h.size(), 5, reps, [&]() {
+            x = h;
+            tr.activate(x);
+        }));
+    }
+    tr.setActivation(ACT_SIMD);
+
+    // model files
+    double model = sizeof(float) * (784 * 225 + 225 * 10) / 1e6;
+    std::string path = std::string(tmp) + ".model";
+    for (const char *ext : { "", ".bin" }) {
+        std::string p = path + ext;
+        std::string kind = *ext ? "binary" : "text";
+        results.push_back(measure("save_model_" + kind, "MB", model, 1, reps / 5 + 1, [&]() {
+            tr.saveModel(p.c_str());
+        }));
+        results.push_back(measure("load_model_" + kind, "MB", model, 1, reps / 5 + 1, [&]() {
+            tr.loadModel(p.c_str());
+        }));
+        unlink(p.c_str());
+    }
+    // half models, timed against the float size
+    for (int prec : { PREC_BF16, PREC_FP16 }) {
+        std::string p = path + ".bin";
+        std::string kind = std::string("binary_") + precision_name(prec);
+        results.push_back(measure("save_model_" + kind, "MB", model, 1, reps / 5 + 1, [&]() {
+            tr.saveModel(p.c_str(), prec);
+        }));
+        results.push_back(measure("load_model_" + kind, "MB", model, 1, reps / 5 + 1, [&]() {
+            tr.loadModel(p.c_str());
+        }));
+        unlink(p.c_str());
+    }
+
+    if (write_json(json, results) < 0) {
+        std::cout << "cannot write: " << json << std::endl;
+        return -1;
+    }
+    std::cout << "written: " << json << ", isa " << isa_name(compiled_isa()) << std::endl;
+    return 0;
+}
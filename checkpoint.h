@@ -0,0 +1,204 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_CHECKPOINT_H
+#define MNIST_CHECKPOINT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "trainer.h"
+
+// writes checkpoints of a trainer while it trains: step() is called
+// between batches, and every batches steps or every seconds it copies the
+// weights into one of two snapshot buffers, which a background thread
+// writes to path as a binary model. training only pays for the copy, and
+// when both buffers are still busy the checkpoint is skipped rather than
+// waited for. T is a trainer or a layer_network
+template<typename T>
+class checkpointer
+{
+public:
+    checkpointer(const T &tr, const std::string &path, int batches, double seconds) : tr(tr), path(path), every(batches), interval(seconds), steps(0), sequence(0), stop(false), written(0), skipped(0), failed(0), copying(0) {
+        for (auto &s : slots) {
+            s.weights.resize(tr.parameters());
+            s.state = FREE;
+            s.sequence = 0;
+        }
+        last = std::chrono::steady_clock::now();
+        writer = std::thread(&checkpointer::write, this);
+    }
+
+    checkpointer(const checkpointer &) = delete;
+    checkpointer &operator=(const checkpointer &) = delete;
+
+    ~checkpointer() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stop = true;
+        }
+        cv.notify_one();
+        writer.join();
+    }
+
+    // called after each batch with the shuffle seed of the epoch and the
+    // records of it trained so far
+    void step(unsigned epoch, size_t trained) {
+        ++steps;
+        if (every > 0 && steps % every == 0) {
+            save(epoch, trained);
+        } else if (interval > 0 && std::chrono::steady_clock::now() - last >= std::chrono::duration<double>(interval)) {
+            save(epoch, trained);
+        }
+    }
+
+    // checkpoint now, false if both buffers are busy
+    bool save(unsigned epoch, size_t trained) {
+        auto bt = std::chrono::steady_clock::now();
+        last = bt;
+        slot *s = nullptr;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            for (auto &c : slots) {
+                if (c.state == FREE) {
+                    s = &c;
+                    break;
+                }
+            }
+            if (!s) {
+                ++skipped;
+                return false;
+            }
+            s->state = COPYING;
+        }
+        tr.snapshot(s->weights.data());
+        s->epoch = epoch;
+        s->trained = trained;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            s->state = READY;
+            s->sequence = ++sequence;
+        }
+        cv.notify_one();
+        copying += std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+        return true;
+    }
+
+    // wait until the checkpoints taken so far are on disk
+    void flush() {
+        std::unique_lock<std::mutex> lk(mtx);
+        done.wait(lk, [this] { return slots[0].state == FREE && slots[1].state == FREE; });
+    }
+
+    // checkpoint now and wait until it is on disk: unlike save() it is
+    // never skipped, it waits for the buffers instead. false if writing
+    // it failed
+    bool saveAndFlush(unsigned epoch, size_t trained) {
+        flush();
+        size_t before = failed;
+        if (!save(epoch, trained)) {
+            return false;
+        }
+        flush();
+        return failed == before;
+    }
+
+    size_t writtenCount() const {
+        return written;
+    }
+
+    size_t skippedCount() const {
+        return skipped;
+    }
+
+    size_t failedCount() const {
+        return failed;
+    }
+
+    // seconds training spent copying snapshots
+    double copySeconds() const {
+        return copying;
+    }
+
+protected:
+    enum { FREE, COPYING, READY, WRITING };
+
+    struct slot
+    {
+        std::vector<float> weights;
+        unsigned epoch;
+        size_t trained;
+        int state;
+        unsigned long sequence;
+    };
+
+    // write the oldest ready snapshot first, so a newer one is never
+    // overwritten on disk by an older one
+    void write() {
+        std::unique_lock<std::mutex> lk(mtx);
+        while (true) {
+            cv.wait(lk, [this] { return stop || slots[0].state == READY || slots[1].state == READY; });
+            slot *s = nullptr;
+            for (auto &c : slots) {
+                if (c.state == READY && (!s || c.sequence < s->sequence)) {
+                    s = &c;
+                }
+            }
+            if (!s) {
+                return;
+            }
+            s->state = WRITING;
+            lk.unlock();
+            int ret = tr.writeSnapshot(path.c_str(), s->weights.data(), s->epoch, s->trained);
+            lk.lock();
+            if (ret < 0) {
+                ++failed;
+            } else {
+                ++written;
+            }
+            s->state = FREE;
+            done.notify_all();
+        }
+    }
+
+    const T &tr;
+    std::string path;
+    int every;
+    double interval;
+    size_t steps;
+    slot slots[2];
+    unsigned long sequence;
+    std::chrono::steady_clock::time_point last;
+    std::thread writer;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::condition_variable done;
+    bool stop;
+    size_t written;
+    size_t skipped;
+    size_t failed;
+    double copying;
+};
+
+#endif
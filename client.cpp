@@ -0,0 +1,188 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// load generator for mnist serve: every connection thread sends records of
+// a dataset one at a time and waits for the answer, then the throughput,
+// the latency percentiles and the accuracy of the answers are printed:
+//   ./client <socket> <dataset> [<connections>] [<requests>] [raw|csv]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "dataset.h"
+#include "server.h"
+
+struct client_stats
+{
+    client_stats() : sent(0), correct(0), errors(0) {
+    }
+
+    latency_histogram latency;
+    size_t sent;
+    size_t correct;
+    size_t errors;
+};
+
+int connect_to(const char *path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool send_all(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+// read one answer line into line, false when the server is gone
+bool read_line(int fd, std::string &line, std::string &buffer)
+{
+    size_t e;
+    while ((e = buffer.find('\n')) == std::string::npos) {
+        char b[4096];
+        ssize_t n = recv(fd, b, sizeof(b), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buffer.append(b, n);
+    }
+    line = buffer.substr(0, e);
+    buffer.erase(0, e + 1);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 6) {
+        std::cout << "usage:" << std::endl;
+        std::cout << "    " << argv[0] << " <socket> <dataset> [<connections>] [<requests>] [raw|csv]" << std::endl;
+        return 0;
+    }
+    dataset data;
+    if (data.load(argv[2]) < 0 || data.size() == 0) {
+        std::cout << "load data failed" << std::endl;
+        return -1;
+    }
+    int connections = argc > 3 ? atoi(argv[3]) : 8;
+    size_t requests = argc > 4 ? strtoull(argv[4], nullptr, 10) : data.size();
+    bool csv = argc > 5 && std::string(argv[5]) == "csv";
+    if (connections <= 0) {
+        connections = 1;
+    }
+    std::vector<client_stats> stats(connections);
+    std::vector<std::thread> threads;
+    bool failed = false;
+    auto bt = std::chrono::steady_clock::now();
+    for (int k = 0; k < connections; ++k) {
+        threads.push_back(std::thread([&, k]() {
+            client_stats &st = stats[k];
+            int fd = connect_to(argv[1]);
+            if (fd < 0) {
+                failed = true;
+                return;
+            }
+            std::string req, line, buffer;
+            for (size_t q = k; q < requests; q += connections) {
+                size_t r = q % data.size();
+                const unsigned char *px = data.pixels(r);
+                req.clear();
+                if (csv) {
+                    req += std::to_string(data.label(r));
+                    for (int i = 0; i < 784; ++i) {
+                        req += ',';
+                        req += std::to_string(px[i]);
+                    }
+                    req += '\n';
+                } else {
+                    req += SERVE_RAW;
+                    req.append(reinterpret_cast<const char *>(px), 784);
+                }
+                auto st0 = std::chrono::steady_clock::now();
+                if (!send_all(fd, req.data(), req.size()) || !read_line(fd, line, buffer)) {
+                    failed = true;
+                    break;
+                }
+                st.latency.add(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - st0).count());
+                ++st.sent;
+                if (line == "error") {
+                    ++st.errors;
+                } else if (atoi(line.c_str()) == data.label(r)) {
+                    ++st.correct;
+                }
+            }
+            close(fd);
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> secs = std::chrono::steady_clock::now() - bt;
+    client_stats total;
+    for (auto &st : stats) {
+        total.latency.merge(st.latency);
+        total.sent += st.sent;
+        total.correct += st.correct;
+        total.errors += st.errors;
+    }
+    if (failed) {
+        std::cout << "cannot talk to: " << argv[1] << std::endl;
+    }
+    std::cout << "sent: " << total.sent << " " << (csv ? "csv" : "raw") << " requests on " << connections
+              << " connections, used " << secs.count() << "sec(s), " << total.sent / secs.count() << " requests/s" << std::endl;
+    if (total.sent > 0) {
+        std::cout << "latency p50 " << total.latency.percentile(50) << "us, p99 " << total.latency.percentile(99)
+                  << "us, max " << total.latency.max() << "us" << std::endl;
+        std::cout << "auc: " << double(total.correct) / total.sent << ", errors: " << total.errors << std::endl;
+    }
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,429 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_DATASET_H
+#define MNIST_DATASET_H
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "thread_pool.h"
+
+inline unsigned char from_digits(const char *c, int length)
+{
+    unsigned char b = 0;
+    for (int i = 0; i < length && i < 3; ++i) {
+        b *= 10;
+        b += c[i] - '0';
+    }
+    return b;
+}
+
+// scale a pixel into [0.001, 1], the same way for training and scoring
+#define PIXEL_SCALE (0.999f / 255)
+#define PIXEL_BIAS 0.001f
+
+inline float normalize_pixel(unsigned char p)
+{
+    return float(p) * PIXEL_SCALE + PIXEL_BIAS;
+}
+
+// parse one csv record: "label,p0,p1,...,p783", pixels are written to v,
+// missing pixels are left zero, returns the label
+inline unsigned char parse_line(const char *p, size_t length, unsigned char *v)
+{
+    unsigned char t = 0;
+    memset(v, 0, 784);
+    const char *b = p, *e = p, *end = p + length;
+    while (e < end) {
+        if (*e == ',') {
+            t = from_digits(b, e - b);
+            b = ++e;
+            break;
+        }
+        ++e;
+    }
+    if (e == end && b == p) {
+        return t;
+    }
+    int i = 0;
+    while (e <= end && i < 784) {
+        if (e == end || *e == ',') {
+            v[i++] = from_digits(b, e - b);
+            b = e + 1;
+        }
+        ++e;
+    }
+    return t;
+}
+
+// parse a csv row with or without the label in front, returns the label,
+// 0 if there is none, or -1 if the row doesn't have 784 or 785 fields. a
+// row without a label is malformed too when labeled is set
+inline int parse_row(const char *p, size_t length, unsigned char *v, bool labeled = false)
+{
+    size_t fields = 1;
+    for (size_t i = 0; i < length; ++i) {
+        fields += p[i] == ',';
+    }
+    if (fields == 785) {
+        return parse_line(p, length, v);
+    }
+    if (fields != 784 || labeled) {
+        return -1;
+    }
+    const char *b = p, *e = p, *end = p + length;
+    int i = 0;
+    while (e <= end && i < 784) {
+        if (e == end || *e == ',') {
+            v[i++] = from_digits(b, e - b);
+            b = e + 1;
+        }
+        ++e;
+    }
+    return 0;
+}
+
+// on-disk layout of the binary dataset cache:
+//   [header, 64 bytes][labels, count bytes][pad][pixels, count * 784 bytes]
+// the pixel slab starts on a 64 byte boundary, so a mapped file can be
+// used in place. the size and modification time of the csv the records
+// were parsed from are kept, a cache is only reused if both still match.
+struct dataset_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint64_t count;
+    uint64_t labels;
+    uint64_t pixels;
+    uint64_t source_size;
+    int64_t source_sec;
+    uint32_t source_nsec;
+    char reserved[4];
+};
+
+class dataset
+{
+public:
+    enum { PIXELS = 784, ALIGN = 64, VERSION = 2 };
+
+    dataset() : count(0), bytes(0), plabels(nullptr), ppixels(nullptr), powned(nullptr), pmap(nullptr), mlength(0) {
+        memset(&source, 0, sizeof(source));
+    }
+
+    dataset(const dataset &) = delete;
+    dataset &operator=(const dataset &) = delete;
+
+    ~dataset() {
+        release();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    unsigned char label(size_t i) const {
+        return plabels[i];
+    }
+
+    const unsigned char *pixels(size_t i) const {
+        return ppixels + i * PIXELS;
+    }
+
+    const unsigned char *labels() const {
+        return plabels;
+    }
+
+    bool mapped() const {
+        return pmap != nullptr;
+    }
+
+    // size of the file the samples were read from
+    size_t sourceBytes() const {
+        return bytes;
+    }
+
+    // use n records stored elsewhere, they must outlive the dataset
+    void view(const unsigned char *labels, const unsigned char *pixels, size_t n) {
+        release();
+        count = n;
+        bytes = n * (PIXELS + 1);
+        plabels = labels;
+        ppixels = pixels;
+    }
+
+    // load a dataset from path, which is either a binary dataset or a csv
+    // file. for csv, a binary cache "<path>.bin" is used if it was written
+    // from a csv of the same size and modification time, otherwise the csv
+    // is parsed and the cache is written.
+    int load(const char *path) {
+        if (isBinary(path)) {
+            return loadBinary(path);
+        }
+        std::string cache = std::string(path) + ".bin";
+        struct stat cs;
+        if (stat(path, &cs) == 0 && access(cache.c_str(), R_OK) == 0) {
+            if (loadBinary(cache.c_str()) == 0 && sameSource(cs)) {
+                std::cout << "mapped cache: " << cache << std::endl;
+                return 0;
+            }
+        }
+        if (loadCsv(path) < 0) {
+            return -1;
+        }
+        if (saveBinary(cache.c_str()) < 0) {
+            std::cout << "cannot write cache: " << cache << std::endl;
+        }
+        return 0;
+    }
+
+    // parse a csv file on all cores: the file is mapped and split into
+    // newline aligned ranges, the records of every range are counted, then
+    // each range is parsed straight into its slot of the sample slab, so
+    // the record order is the same as reading the file line by line
+    int loadCsv(const char *path, int threads = 0) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return -1;
+        }
+        size_t length = st.st_size;
+        const char *text = nullptr;
+        source = st;
+        if (length > 0) {
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            madvise(p, length, MADV_SEQUENTIAL);
+            text = static_cast<const char *>(p);
+        }
+        close(fd);
+        release();
+        thread_pool pool(threads);
+        int parts = length < (1 << 20) ? 1 : pool.size() * 4;
+        std::vector<size_t> bounds(parts + 1, length);
+        bounds[0] = 0;
+        for (int i = 1; i < parts; ++i) {
+            size_t b = length / parts * i;
+            if (b < bounds[i - 1]) {
+                b = bounds[i - 1];
+            }
+            const void *nl = b < length ? memchr(text + b, '\n', length - b) : nullptr;
+            bounds[i] = nl ? static_cast<const char *>(nl) - text + 1 : length;
+        }
+        std::vector<size_t> offsets(parts + 1, 0);
+        pool.run(parts, [&](int i) {
+            offsets[i + 1] = countLines(text + bounds[i], bounds[i + 1] - bounds[i]);
+        });
+        for (int i = 0; i < parts; ++i) {
+            offsets[i + 1] += offsets[i];
+        }
+        int ret = allocate(offsets[parts]);
+        if (ret == 0) {
+            pool.run(parts, [&](int i) {
+                parseRange(text + bounds[i], bounds[i + 1] - bounds[i], &vlabels[offsets[i]], powned + offsets[i] * PIXELS);
+            });
+            count = offsets[parts];
+            plabels = vlabels.data();
+            ppixels = powned;
+            bytes = length;
+        }
+        if (text) {
+            munmap(const_cast<char *>(text), length);
+        }
+        return ret;
+    }
+
+    int loadBinary(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(dataset_header)) {
+            close(fd);
+            return -1;
+        }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return -1;
+        }
+        const dataset_header *h = static_cast<const dataset_header *>(p);
+        if (!validHeader(*h, st.st_size)) {
+            munmap(p, st.st_size);
+            return -1;
+        }
+        release();
+        pmap = p;
+        mlength = st.st_size;
+        count = h->count;
+        bytes = mlength;
+        plabels = static_cast<const unsigned char *>(p) + h->labels;
+        ppixels = static_cast<const unsigned char *>(p) + h->pixels;
+        return 0;
+    }
+
+    int saveBinary(const char *path) const {
+        std::string tmp = std::string(path) + ".tmp";
+        std::ofstream os(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!os.is_open()) {
+            return -1;
+        }
+        dataset_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MNISTDS", 8);
+        h.version = VERSION;
+        h.dim = PIXELS;
+        h.count = count;
+        h.labels = sizeof(dataset_header);
+        h.pixels = (h.labels + count + ALIGN - 1) / ALIGN * ALIGN;
+        h.source_size = source.st_size;
+        h.source_sec = source.st_mtim.tv_sec;
+        h.source_nsec = source.st_mtim.tv_nsec;
+        os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        os.write(reinterpret_cast<const char *>(plabels), count);
+        char pad[ALIGN] = {0};
+        os.write(pad, h.pixels - h.labels - count);
+        os.write(reinterpret_cast<const char *>(ppixels), count * PIXELS);
+        os.close();
+        if (!os || rename(tmp.c_str(), path) < 0) {
+            unlink(tmp.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    static bool isBinary(const char *path) {
+        char magic[8] = {0};
+        std::ifstream is(path, std::ios::in | std::ios::binary);
+        if (!is.is_open() || !is.read(magic, sizeof(magic))) {
+            return false;
+        }
+        return memcmp(magic, "MNISTDS", 8) == 0;
+    }
+
+protected:
+    static bool validHeader(const dataset_header &h, size_t length) {
+        if (memcmp(h.magic, "MNISTDS", 8) != 0 || h.version != VERSION || h.dim != PIXELS) {
+            return false;
+        }
+        if (h.pixels % ALIGN != 0 || h.labels < sizeof(dataset_header) || h.labels > h.pixels || h.pixels > length) {
+            return false;
+        }
+        return h.count <= h.pixels - h.labels && h.count <= (length - h.pixels) / PIXELS;
+    }
+
+    // whether the mapped cache was written from the file described by st
+    bool sameSource(const struct stat &st) const {
+        if (!pmap) {
+            return false;
+        }
+        const dataset_header *h = static_cast<const dataset_header *>(pmap);
+        return h->source_size == uint64_t(st.st_size) && h->source_sec == int64_t(st.st_mtim.tv_sec) && h->source_nsec == uint32_t(st.st_mtim.tv_nsec);
+    }
+
+    static size_t countLines(const char *p, size_t n) {
+        size_t lines = 0;
+        const char *e = p + n;
+        while (p < e) {
+            const void *nl = memchr(p, '\n', e - p);
+            if (!nl) {
+                break;
+            }
+            p = static_cast<const char *>(nl) + 1;
+            ++lines;
+        }
+        return p < e ? lines + 1 : lines;
+    }
+
+    static void parseRange(const char *p, size_t n, unsigned char *labels, unsigned char *pixels) {
+        const char *e = p + n;
+        while (p < e) {
+            const void *nl = memchr(p, '\n', e - p);
+            const char *le = nl ? static_cast<const char *>(nl) : e;
+            *labels++ = parse_line(p, le - p, pixels);
+            pixels += PIXELS;
+            p = le + 1;
+        }
+    }
+
+    int allocate(size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, ALIGN, n > 0 ? n * PIXELS : size_t(ALIGN)) != 0) {
+            std::cout << "cannot allocate " << n << " records" << std::endl;
+            return -1;
+        }
+        powned = static_cast<unsigned char *>(p);
+        vlabels.resize(n);
+        return 0;
+    }
+
+    void release() {
+        if (pmap) {
+            munmap(pmap, mlength);
+            pmap = nullptr;
+            mlength = 0;
+        }
+        if (powned) {
+            free(powned);
+            powned = nullptr;
+        }
+        vlabels.clear();
+        count = 0;
+        bytes = 0;
+        plabels = nullptr;
+        ppixels = nullptr;
+    }
+
+    size_t count;
+    size_t bytes;
+
+    const unsigned char *plabels;
+    const unsigned char *ppixels;
+
+    std::vector<unsigned char> vlabels;
+    unsigned char *powned;
+
+    void *pmap;
+    size_t mlength;
+
+    struct stat source;
+};
+
+#endif
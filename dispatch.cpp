@@ -0,0 +1,61 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+// the main of a program built for several isa levels, MNIST_PROGRAM is the
+// program name. an --isa=<level> option among the leading options forces
+// a level, otherwise the best one the cpu supports runs
+
+#include <iostream>
+#include <string>
+#include "dispatch.h"
+
+#define ISA_DECLARE(isa) extern "C" int ISA_MAIN(MNIST_PROGRAM, isa)(int argc, char *argv[]);
+ISA_DECLARE(sse2)
+ISA_DECLARE(avx2)
+ISA_DECLARE(avx512)
+
+int main(int argc, char *argv[])
+{
+    typedef int (*entry)(int, char *[]);
+    const entry entries[ISA_LEVELS] = { ISA_MAIN(MNIST_PROGRAM, sse2), ISA_MAIN(MNIST_PROGRAM, avx2), ISA_MAIN(MNIST_PROGRAM, avx512) };
+    int cpu = cpu_isa(), level = cpu;
+    for (int i = 1; i < argc && std::string(argv[i]).substr(0, 2) == "--"; ++i) {
+        std::string opt = argv[i];
+        if (opt.substr(0, 6) != "--isa=") {
+            continue;
+        }
+        level = parse_isa(opt.substr(6));
+        if (level < 0) {
+            std::cout << "invalid isa: " << opt.substr(6) << std::endl;
+            return 0;
+        }
+        if (level > cpu) {
+            std::cout << "cpu has no " << opt.substr(6) << ", best is " << isa_name(cpu) << std::endl;
+            return 0;
+        }
+        for (int j = i; j + 1 < argc; ++j) {
+            argv[j] = argv[j + 1];
+        }
+        argv[--argc] = nullptr;
+        break;
+    }
+    return entries[level](argc, argv);
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_DISPATCH_H
+#define MNIST_DISPATCH_H
+
+#include <string>
+#include <cstdint>
+#include <cpuid.h>
+
+// make builds the programs once per isa level and links the builds with
+// dispatch.cpp, which runs the best one the cpu supports:
+//   ISA_SSE2    the x86-64 baseline
+//   ISA_AVX2    avx2, fma and f16c
+//   ISA_AVX512  avx512 f, cd, bw, dq and vl on top of avx2
+// eigen and the kernels pick their instructions from the compiler flags of
+// the build they are in
+enum isa_level
+{
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_LEVELS
+};
+
+inline const char *isa_name(int level)
+{
+    switch (level) {
+    case ISA_AVX2:
+        return "avx2";
+    case ISA_AVX512:
+        return "avx512";
+    default:
+        return "sse2";
+    }
+}
+
+// the level named s, -1 for an unknown name
+inline int parse_isa(const std::string &s)
+{
+    for (int level = 0; level < ISA_LEVELS; ++level) {
+        if (s == isa_name(level)) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// the level the including file is compiled for
+inline int compiled_isa()
+{
+#if defined(__AVX512F__) && defined(__AVX512CD__) && defined(__AVX512BW__) && defined(__AVX512DQ__) && defined(__AVX512VL__)
+    return ISA_AVX512;
+#elif defined(__AVX2__) && defined(__FMA__) && defined(__F16C__)
+    return ISA_AVX2;
+#else
+    return ISA_SSE2;
+#endif
+}
+
+// the best level of this cpu, from cpuid. the wider registers also need
+// the os to save them on context switches, which xgetbv tells
+inline int cpu_isa()
+{
+    unsigned a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return ISA_SSE2;
+    }
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX) || !(c & bit_FMA) || !(c & bit_F16C)) {
+        return ISA_SSE2;
+    }
+    uint32_t xcr0, xcr0hi;
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0hi) : "c"(0));
+    // sse and avx state
+    if ((xcr0 & 0x6) != 0x6) {
+        return ISA_SSE2;
+    }
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d) || !(b & bit_AVX2)) {
+        return ISA_SSE2;
+    }
+    // opmask and the upper halves of zmm0-15 and zmm16-31
+    const unsigned avx512 = bit_AVX512F | bit_AVX512CD | bit_AVX512BW | bit_AVX512DQ | bit_AVX512VL;
+    if ((xcr0 & 0xe6) == 0xe6 && (b & avx512) == avx512) {
+        return ISA_AVX512;
+    }
+    return ISA_AVX2;
+}
+
+// the entry point of program built for level isa, a program built for a
+// single level has a main instead
+#define ISA_MAIN(program, isa) ISA_MAIN_NAME(program, isa)
+#define ISA_MAIN_NAME(program, isa) program##_main_##isa
+
+#endif
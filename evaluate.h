@@ -0,0 +1,137 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_EVALUATE_H
+#define MNIST_EVALUATE_H
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <cstring>
+#include "trainer.h"
+#include "dataset.h"
+#include "pipeline.h"
+#include "quantize.h"
+#include "thread_pool.h"
+
+struct evaluation
+{
+    evaluation() : count(0), correct(0) {
+        memset(confusion, 0, sizeof(confusion));
+    }
+
+    void merge(const evaluation &o) {
+        count += o.count;
+        correct += o.correct;
+        for (int i = 0; i < 10; ++i) {
+            for (int j = 0; j < 10; ++j) {
+                confusion[i][j] += o.confusion[i][j];
+            }
+        }
+    }
+
+    double accuracy() const {
+        return count ? double(correct) / count : 0;
+    }
+
+    // rows are targets, columns are predictions
+    void print(std::ostream &os) const {
+        os << "target\\predict";
+        for (int j = 0; j < 10; ++j) {
+            os << std::setw(7) << j;
+        }
+        os << std::endl;
+        for (int i = 0; i < 10; ++i) {
+            os << std::setw(14) << i;
+            for (int j = 0; j < 10; ++j) {
+                os << std::setw(7) << confusion[i][j];
+            }
+            os << std::endl;
+        }
+    }
+
+    size_t count;
+    size_t correct;
+    size_t confusion[10][10];
+};
+
+// score records [b, b + n) of data into o, float models take the records
+// normalized into m
+template<typename T>
+void score_records(const T &tr, const dataset &data, size_t b, int n, Matrix<float, Dynamic, 784, RowMajor> &m, Matrix<float, Dynamic, 10> &o)
+{
+    {
+        PROFILE_SCOPE(PROF_CONVERT, n);
+        if (m.rows() != n) {
+            m.resize(n, 784);
+        }
+        for (int i = 0; i < n; ++i) {
+            convert_pixels(data.pixels(b + i), m.row(i).data(), 784);
+        }
+    }
+    tr.predict(m, o);
+}
+
+// quantized models read the pixels in place
+template<int INPUT, int HIDDEN, int OUTPUT>
+void score_records(const quantized_model<INPUT, HIDDEN, OUTPUT> &qm, const dataset &data, size_t b, int n, Matrix<float, Dynamic, 784, RowMajor> &, Matrix<float, Dynamic, 10> &o)
+{
+    qm.predict(data.pixels(b), n, o);
+}
+
+// score the first count records of data: the range is split into one
+// contiguous slice per pool thread, every slice is scored in batches of
+// batch records with its own buffers, and the partial results are merged
+template<typename T>
+evaluation evaluate(const T &tr, const dataset &data, size_t count, thread_pool &pool, int batch = 256)
+{
+    int tasks = pool.size();
+    std::vector<evaluation> parts(tasks);
+    pool.run(tasks, [&](int t) {
+        size_t b = count * t / tasks, e = count * (t + 1) / tasks;
+        Matrix<float, Dynamic, 784, RowMajor> m;
+        Matrix<float, Dynamic, 10> o;
+        evaluation &r = parts[t];
+        while (b < e) {
+            int n = e - b < size_t(batch) ? e - b : batch;
+            score_records(tr, data, b, n, m, o);
+            for (int i = 0; i < n; ++i) {
+                int pi;
+                o.row(i).maxCoeff(&pi);
+                int target = data.label(b + i);
+                if (target < 10) {
+                    ++r.confusion[target][pi];
+                }
+                if (pi == target) {
+                    ++r.correct;
+                }
+                ++r.count;
+            }
+            b += n;
+        }
+    });
+    evaluation total;
+    for (auto &p : parts) {
+        total.merge(p);
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,350 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_HALF_H
+#define MNIST_HALF_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <immintrin.h>
+
+// precision of the weights and activations a network computes with,
+// selected by setPrecision()
+//   PREC_FP32  float everywhere
+//   PREC_BF16  bfloat16: the float exponent with 8 bits of mantissa
+//   PREC_FP16  ieee half: 5 bits of exponent, 11 bits of mantissa, the
+//              largest value 65504
+// in the half modes the weights the products read are stored packed in 16
+// bits and widened to floats inside the products, while the updates go
+// into float master weights which are converted again after every update.
+// the activations are rounded to the nearest half value in place, they
+// only live in chunk sized buffers. rounding is to nearest even, the same
+// as the F16C instructions
+enum precision
+{
+    PREC_FP32,
+    PREC_BF16,
+    PREC_FP16
+};
+
+inline const char *precision_name(int prec)
+{
+    switch (prec) {
+    case PREC_BF16:
+        return "bf16";
+    case PREC_FP16:
+        return "fp16";
+    default:
+        return "fp32";
+    }
+}
+
+// -1 for an unknown name
+inline int parse_precision(const std::string &s)
+{
+    for (int p : { PREC_FP32, PREC_BF16, PREC_FP16 }) {
+        if (s == precision_name(p)) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+inline uint16_t float_to_bf16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000) {
+        return (x >> 16) | 0x40;
+    }
+    x += 0x7fff + ((x >> 16) & 1);
+    return x >> 16;
+}
+
+inline float bf16_to_float(uint16_t h)
+{
+    uint32_t x = uint32_t(h) << 16;
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// without F16C: the rounding bias trick for normals, and an add of 0.5
+// for the values that become subnormal halves, where 0.5 puts the float
+// ulp at the half subnormal step
+inline uint16_t float_to_fp16(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000, ax = x & 0x7fffffff;
+    if (ax >= 0x7f800000) {
+        return sign | 0x7c00 | (ax > 0x7f800000 ? 0x200 : 0);
+    }
+    if (ax >= 0x477ff000) {
+        return sign | 0x7c00;
+    }
+    if (ax < 0x38800000) {
+        float af;
+        memcpy(&af, &ax, sizeof(af));
+        af += 0.5f;
+        memcpy(&ax, &af, sizeof(ax));
+        return sign | (ax - 0x3f000000);
+    }
+    ax += 0xc8000fff + ((ax >> 13) & 1);
+    return sign | (ax >> 13);
+}
+
+inline float fp16_to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    uint32_t x;
+    if (e == 0) {
+        float f = m * (1.0f / 16777216);
+        memcpy(&x, &f, sizeof(x));
+        x |= sign;
+    } else if (e == 31) {
+        x = sign | 0x7f800000 | (m << 13);
+    } else {
+        x = sign | ((e + 112) << 23) | (m << 13);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+#ifdef __AVX512F__
+// the upper half of every float rounded to nearest even, nans kept quiet
+inline __m512i bf16_round_avx512(__m512 x)
+{
+    __m512i u = _mm512_castps_si512(x);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+    __m512i r = _mm512_add_epi32(u, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff)));
+    __mmask16 nan = _mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q);
+    return _mm512_mask_or_epi32(r, nan, u, _mm512_set1_epi32(0x400000));
+}
+#endif
+
+#ifdef __AVX2__
+inline __m256i bf16_round_avx2(__m256 x)
+{
+    __m256i u = _mm256_castps_si256(x);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+    __m256i r = _mm256_add_epi32(u, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7fff)));
+    __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+    return _mm256_blendv_epi8(r, _mm256_or_si256(u, _mm256_set1_epi32(0x400000)), nan);
+}
+#elif defined(__SSE2__)
+inline __m128i bf16_round_sse2(__m128 x)
+{
+    __m128i u = _mm_castps_si128(x);
+    __m128i lsb = _mm_and_si128(_mm_srli_epi32(u, 16), _mm_set1_epi32(1));
+    __m128i r = _mm_add_epi32(u, _mm_add_epi32(lsb, _mm_set1_epi32(0x7fff)));
+    __m128i nan = _mm_castps_si128(_mm_cmpunord_ps(x, x));
+    return _mm_or_si128(_mm_andnot_si128(nan, r), _mm_and_si128(nan, _mm_or_si128(u, _mm_set1_epi32(0x400000))));
+}
+#endif
+
+// x[i] = the nearest half value of x[i] in place, what storing a value in
+// half and reading it back gives
+inline void round_half(float *x, size_t n, int prec)
+{
+    size_t i = 0;
+    if (prec == PREC_BF16) {
+#ifdef __AVX512F__
+        const __m512i high16 = _mm512_set1_epi32(0xffff0000);
+        for (; i < n - n % 16; i += 16) {
+            __m512i r = bf16_round_avx512(_mm512_loadu_ps(x + i));
+            _mm512_storeu_ps(x + i, _mm512_castsi512_ps(_mm512_and_si512(r, high16)));
+        }
+#endif
+#ifdef __AVX2__
+        const __m256i high = _mm256_set1_epi32(0xffff0000);
+        for (; i < n - n % 8; i += 8) {
+            __m256i r = bf16_round_avx2(_mm256_loadu_ps(x + i));
+            _mm256_storeu_ps(x + i, _mm256_castsi256_ps(_mm256_and_si256(r, high)));
+        }
+#elif defined(__SSE2__)
+        const __m128i high = _mm_set1_epi32(0xffff0000);
+        for (; i < n - n % 4; i += 4) {
+            __m128i r = bf16_round_sse2(_mm_loadu_ps(x + i));
+            _mm_storeu_ps(x + i, _mm_castsi128_ps(_mm_and_si128(r, high)));
+        }
+#endif
+        for (; i < n; ++i) {
+            x[i] = bf16_to_float(float_to_bf16(x[i]));
+        }
+    } else if (prec == PREC_FP16) {
+#ifdef __AVX512F__
+        for (; i < n - n % 16; i += 16) {
+            __m256i h = _mm512_cvtps_ph(_mm512_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm512_storeu_ps(x + i, _mm512_cvtph_ps(h));
+        }
+#endif
+#ifdef __F16C__
+        for (; i < n - n % 8; i += 8) {
+            __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm256_storeu_ps(x + i, _mm256_cvtph_ps(h));
+        }
+#endif
+        for (; i < n; ++i) {
+            x[i] = fp16_to_float(float_to_fp16(x[i]));
+        }
+    }
+}
+
+// h[i] = x[i] stored in half, for the half models
+inline void to_half(const float *x, uint16_t *h, size_t n, int prec)
+{
+    size_t i = 0;
+    if (prec == PREC_BF16) {
+#ifdef __AVX512F__
+        for (; i < n - n % 16; i += 16) {
+            __m512i r = _mm512_srli_epi32(bf16_round_avx512(_mm512_loadu_ps(x + i)), 16);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(h + i), _mm512_cvtepi32_epi16(r));
+        }
+#endif
+#ifdef __AVX2__
+        for (; i < n - n % 8; i += 8) {
+            __m256i r = _mm256_srli_epi32(bf16_round_avx2(_mm256_loadu_ps(x + i)), 16);
+            __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi32(r, r), 0xd8);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(h + i), _mm256_castsi256_si128(p));
+        }
+#endif
+        for (; i < n; ++i) {
+            h[i] = float_to_bf16(x[i]);
+        }
+    } else {
+#ifdef __AVX512F__
+        for (; i < n - n % 16; i += 16) {
+            __m256i r = _mm512_cvtps_ph(_mm512_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(h + i), r);
+        }
+#endif
+#ifdef __F16C__
+        for (; i < n - n % 8; i += 8) {
+            __m128i r = _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(h + i), r);
+        }
+#endif
+        for (; i < n; ++i) {
+            h[i] = float_to_fp16(x[i]);
+        }
+    }
+}
+
+// x[i] = h[i] read back from half
+inline void from_half(const uint16_t *h, float *x, size_t n, int prec)
+{
+    size_t i = 0;
+    if (prec == PREC_BF16) {
+#ifdef __AVX512F__
+        for (; i < n - n % 16; i += 16) {
+            __m512i w = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(h + i)));
+            _mm512_storeu_ps(x + i, _mm512_castsi512_ps(_mm512_slli_epi32(w, 16)));
+        }
+#endif
+#ifdef __AVX2__
+        for (; i < n - n % 8; i += 8) {
+            __m256i w = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i)));
+            _mm256_storeu_ps(x + i, _mm256_castsi256_ps(_mm256_slli_epi32(w, 16)));
+        }
+#endif
+        for (; i < n; ++i) {
+            x[i] = bf16_to_float(h[i]);
+        }
+    } else {
+#ifdef __AVX512F__
+        for (; i < n - n % 16; i += 16) {
+            _mm512_storeu_ps(x + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(h + i))));
+        }
+#endif
+#ifdef __F16C__
+        for (; i < n - n % 8; i += 8) {
+            _mm256_storeu_ps(x + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(h + i))));
+        }
+#endif
+        for (; i < n; ++i) {
+            x[i] = fp16_to_float(h[i]);
+        }
+    }
+}
+
+// a weight of precision P as it is stored, and widened back to a float.
+// the vector loads read 8 values even for a partial vector of half values,
+// so half rows loaded that way need HALF_PAD values of padding after them
+enum { HALF_PAD = 8 };
+
+template<int P>
+struct half_traits
+{
+    typedef uint16_t type;
+
+    static float widen(uint16_t h) {
+        return P == PREC_BF16 ? bf16_to_float(h) : fp16_to_float(h);
+    }
+
+#ifdef __AVX2__
+    static __m256 widen8(const uint16_t *h) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(h));
+        if (P == PREC_BF16) {
+            return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(v), 16));
+        }
+#ifdef __F16C__
+        return _mm256_cvtph_ps(v);
+#else
+        float f[8];
+        for (int i = 0; i < 8; ++i) {
+            f[i] = fp16_to_float(h[i]);
+        }
+        return _mm256_loadu_ps(f);
+#endif
+    }
+
+    // the lanes outside mask are loaded too, from the padding
+    static __m256 widen8(const uint16_t *h, __m256i) {
+        return widen8(h);
+    }
+#endif
+};
+
+template<>
+struct half_traits<PREC_FP32>
+{
+    typedef float type;
+
+    static float widen(float x) {
+        return x;
+    }
+
+#ifdef __AVX2__
+    static __m256 widen8(const float *x) {
+        return _mm256_loadu_ps(x);
+    }
+
+    static __m256 widen8(const float *x, __m256i mask) {
+        return _mm256_maskload_ps(x, mask);
+    }
+#endif
+};
+
+#endif
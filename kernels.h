@@ -0,0 +1,335 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_KERNELS_H
+#define MNIST_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <immintrin.h>
+#include <Eigen/Dense>
+
+// activation kernels, selected by trainer::setActivation()
+//   ACT_EIGEN  eigen array expression, kept as the reference
+//   ACT_SIMD   cephes style exp, max abs error of sigmoid below 1e-7,
+//              the same as the eigen path
+//   ACT_FAST   degree 3 exp2 polynomial, max abs error of sigmoid below 4e-5
+// the errors are measured against a double precision sigmoid by
+// sigmoid_max_error() over [-20, 20], the act command prints them
+enum activation
+{
+    ACT_EIGEN,
+    ACT_SIMD,
+    ACT_FAST
+};
+
+inline const char *activation_name(int act)
+{
+    switch (act) {
+    case ACT_SIMD:
+        return "simd";
+    case ACT_FAST:
+        return "fast";
+    default:
+        return "eigen";
+    }
+}
+
+#define EXP_HI 88.3762626647949f
+#define EXP_LO -87.3365478515625f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_C1 0.693359375f
+#define EXP_C2 -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+#define EXP2_F1 0.6960656421638072f
+#define EXP2_F2 0.224494337302845f
+#define EXP2_F3 0.07944023841053369f
+
+inline float pow2i(int k)
+{
+    uint32_t b = uint32_t(k + 127) << 23;
+    float f;
+    memcpy(&f, &b, sizeof(f));
+    return f;
+}
+
+inline float exp_accurate(float x)
+{
+    x = x > EXP_HI ? EXP_HI : (x < EXP_LO ? EXP_LO : x);
+    float fx = std::floor(x * EXP_LOG2E + 0.5f);
+    x = x - fx * EXP_C1 - fx * EXP_C2;
+    float y = EXP_P0;
+    y = y * x + EXP_P1;
+    y = y * x + EXP_P2;
+    y = y * x + EXP_P3;
+    y = y * x + EXP_P4;
+    y = y * x + EXP_P5;
+    y = y * x * x + x + 1.0f;
+    return y * pow2i(int(fx));
+}
+
+inline float exp_fast(float x)
+{
+    float t = x * EXP_LOG2E;
+    t = t > 126.0f ? 126.0f : (t < -126.0f ? -126.0f : t);
+    float k = std::floor(t);
+    float f = t - k;
+    float p = 1.0f + f * (EXP2_F1 + f * (EXP2_F2 + f * EXP2_F3));
+    return p * pow2i(int(k));
+}
+
+#ifdef __AVX2__
+
+#ifdef __FMA__
+#define MM256_FMADD(a, b, c) _mm256_fmadd_ps(a, b, c)
+#else
+#define MM256_FMADD(a, b, c) _mm256_add_ps(_mm256_mul_ps(a, b), c)
+#endif
+
+inline __m256 exp_accurate(__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(EXP_LO)), _mm256_set1_ps(EXP_HI));
+    __m256 fx = _mm256_floor_ps(MM256_FMADD(x, _mm256_set1_ps(EXP_LOG2E), _mm256_set1_ps(0.5f)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(EXP_C1)));
+    x = _mm256_sub_ps(x, _mm256_mul_ps(fx, _mm256_set1_ps(EXP_C2)));
+    __m256 y = _mm256_set1_ps(EXP_P0);
+    y = MM256_FMADD(y, x, _mm256_set1_ps(EXP_P1));
+    y = MM256_FMADD(y, x, _mm256_set1_ps(EXP_P2));
+    y = MM256_FMADD(y, x, _mm256_set1_ps(EXP_P3));
+    y = MM256_FMADD(y, x, _mm256_set1_ps(EXP_P4));
+    y = MM256_FMADD(y, x, _mm256_set1_ps(EXP_P5));
+    y = MM256_FMADD(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+    __m256i k = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(fx), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(k));
+}
+
+inline __m256 exp_fast(__m256 x)
+{
+    __m256 t = _mm256_mul_ps(x, _mm256_set1_ps(EXP_LOG2E));
+    t = _mm256_min_ps(_mm256_max_ps(t, _mm256_set1_ps(-126.0f)), _mm256_set1_ps(126.0f));
+    __m256 k = _mm256_floor_ps(t);
+    __m256 f = _mm256_sub_ps(t, k);
+    __m256 p = MM256_FMADD(f, _mm256_set1_ps(EXP2_F3), _mm256_set1_ps(EXP2_F2));
+    p = MM256_FMADD(f, p, _mm256_set1_ps(EXP2_F1));
+    p = MM256_FMADD(f, p, _mm256_set1_ps(1.0f));
+    __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvttps_epi32(k), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+#elif defined(__SSE2__)
+
+// sse2 has no floor, truncate and step down where that rounded up
+inline __m128 floor_sse2(__m128 x)
+{
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, x), _mm_set1_ps(1.0f)));
+}
+
+inline __m128 exp_accurate(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(EXP_LO)), _mm_set1_ps(EXP_HI));
+    __m128 fx = floor_sse2(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(EXP_LOG2E)), _mm_set1_ps(0.5f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(EXP_C1)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(EXP_C2)));
+    __m128 y = _mm_set1_ps(EXP_P0);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(EXP_P1));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(EXP_P2));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(EXP_P3));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(EXP_P4));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(EXP_P5));
+    y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), _mm_add_ps(x, _mm_set1_ps(1.0f)));
+    __m128i k = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(k));
+}
+
+inline __m128 exp_fast(__m128 x)
+{
+    __m128 t = _mm_mul_ps(x, _mm_set1_ps(EXP_LOG2E));
+    t = _mm_min_ps(_mm_max_ps(t, _mm_set1_ps(-126.0f)), _mm_set1_ps(126.0f));
+    __m128 k = floor_sse2(t);
+    __m128 f = _mm_sub_ps(t, k);
+    __m128 p = _mm_add_ps(_mm_mul_ps(f, _mm_set1_ps(EXP2_F3)), _mm_set1_ps(EXP2_F2));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(EXP2_F1));
+    p = _mm_add_ps(_mm_mul_ps(f, p), _mm_set1_ps(1.0f));
+    __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(k), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(p, _mm_castsi128_ps(e));
+}
+
+#endif
+
+// 16 lanes, the same operations as the avx2 versions with fma, so a value
+// gets the same result in either
+#ifdef __AVX512F__
+
+inline __m512 floor_avx512(__m512 x)
+{
+    return _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+
+inline __m512 exp_accurate(__m512 x)
+{
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(EXP_LO)), _mm512_set1_ps(EXP_HI));
+    __m512 fx = floor_avx512(_mm512_fmadd_ps(x, _mm512_set1_ps(EXP_LOG2E), _mm512_set1_ps(0.5f)));
+    x = _mm512_sub_ps(x, _mm512_mul_ps(fx, _mm512_set1_ps(EXP_C1)));
+    x = _mm512_sub_ps(x, _mm512_mul_ps(fx, _mm512_set1_ps(EXP_C2)));
+    __m512 y = _mm512_set1_ps(EXP_P0);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P1));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P2));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P3));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P4));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(EXP_P5));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+    __m512i k = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(fx), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(k));
+}
+
+inline __m512 exp_fast(__m512 x)
+{
+    __m512 t = _mm512_mul_ps(x, _mm512_set1_ps(EXP_LOG2E));
+    t = _mm512_min_ps(_mm512_max_ps(t, _mm512_set1_ps(-126.0f)), _mm512_set1_ps(126.0f));
+    __m512 k = floor_avx512(t);
+    __m512 f = _mm512_sub_ps(t, k);
+    __m512 p = _mm512_fmadd_ps(f, _mm512_set1_ps(EXP2_F3), _mm512_set1_ps(EXP2_F2));
+    p = _mm512_fmadd_ps(f, p, _mm512_set1_ps(EXP2_F1));
+    p = _mm512_fmadd_ps(f, p, _mm512_set1_ps(1.0f));
+    __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvttps_epi32(k), _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(p, _mm512_castsi512_ps(e));
+}
+
+#endif
+
+// x = 1 / (1 + exp(-x)), in place
+template<bool FAST>
+inline void sigmoid_kernel(float *x, size_t n)
+{
+    size_t i = 0;
+#ifdef __AVX512F__
+    const __m512 one16 = _mm512_set1_ps(1.0f);
+    const __m512i sign16 = _mm512_set1_epi32(int(0x80000000u));
+    for (; i < n - n % 16; i += 16) {
+        __m512 v = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_mm512_loadu_ps(x + i)), sign16));
+        __m512 e = FAST ? exp_fast(v) : exp_accurate(v);
+        _mm512_storeu_ps(x + i, _mm512_div_ps(one16, _mm512_add_ps(one16, e)));
+    }
+#endif
+#ifdef __AVX2__
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 neg = _mm256_set1_ps(-0.0f);
+    for (; i < n - n % 8; i += 8) {
+        __m256 v = _mm256_xor_ps(_mm256_loadu_ps(x + i), neg);
+        __m256 e = FAST ? exp_fast(v) : exp_accurate(v);
+        _mm256_storeu_ps(x + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+    }
+#elif defined(__SSE2__)
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 neg = _mm_set1_ps(-0.0f);
+    for (; i < n - n % 4; i += 4) {
+        __m128 v = _mm_xor_ps(_mm_loadu_ps(x + i), neg);
+        __m128 e = FAST ? exp_fast(v) : exp_accurate(v);
+        _mm_storeu_ps(x + i, _mm_div_ps(one, _mm_add_ps(one, e)));
+    }
+#endif
+    for (; i < n; ++i) {
+        float e = FAST ? exp_fast(-x[i]) : exp_accurate(-x[i]);
+        x[i] = 1.0f / (1.0f + e);
+    }
+}
+
+inline void sigmoid_simd(float *x, size_t n)
+{
+    sigmoid_kernel<false>(x, n);
+}
+
+inline void sigmoid_fast(float *x, size_t n)
+{
+    sigmoid_kernel<true>(x, n);
+}
+
+// backward pass: err *= y * (1 - y), y being the sigmoid outputs, which
+// is the error times the sigmoid derivative at the same input
+inline void sigmoid_grad_mul(float *err, const float *y, size_t n)
+{
+    size_t i = 0;
+#ifdef __AVX512F__
+    const __m512 one16 = _mm512_set1_ps(1.0f);
+    for (; i < n - n % 16; i += 16) {
+        __m512 v = _mm512_loadu_ps(y + i);
+        __m512 d = _mm512_mul_ps(v, _mm512_sub_ps(one16, v));
+        _mm512_storeu_ps(err + i, _mm512_mul_ps(_mm512_loadu_ps(err + i), d));
+    }
+#endif
+#ifdef __AVX2__
+    const __m256 one = _mm256_set1_ps(1.0f);
+    for (; i < n - n % 8; i += 8) {
+        __m256 v = _mm256_loadu_ps(y + i);
+        __m256 d = _mm256_mul_ps(v, _mm256_sub_ps(one, v));
+        _mm256_storeu_ps(err + i, _mm256_mul_ps(_mm256_loadu_ps(err + i), d));
+    }
+#elif defined(__SSE2__)
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (; i < n - n % 4; i += 4) {
+        __m128 v = _mm_loadu_ps(y + i);
+        __m128 d = _mm_mul_ps(v, _mm_sub_ps(one, v));
+        _mm_storeu_ps(err + i, _mm_mul_ps(_mm_loadu_ps(err + i), d));
+    }
+#endif
+    for (; i < n; ++i) {
+        err[i] *= y[i] * (1.0f - y[i]);
+    }
+}
+
+// max abs difference between a kernel and the double precision sigmoid
+inline double sigmoid_max_error(int act)
+{
+    const int n = 400001;
+    float *x = new float[n];
+    for (int i = 0; i < n; ++i) {
+        x[i] = -20.0f + 40.0f * i / (n - 1);
+    }
+    float *y = new float[n];
+    memcpy(y, x, n * sizeof(float));
+    if (act == ACT_FAST) {
+        sigmoid_fast(y, n);
+    } else if (act == ACT_SIMD) {
+        sigmoid_simd(y, n);
+    } else {
+        Eigen::Map<Eigen::ArrayXf> m(y, n);
+        m = (1.0f + (-m).exp()).inverse();
+    }
+    double err = 0;
+    for (int i = 0; i < n; ++i) {
+        double d = std::fabs(y[i] - 1.0 / (1.0 + std::exp(-double(x[i]))));
+        if (d > err) {
+            err = d;
+        }
+    }
+    delete[] y;
+    delete[] x;
+    return err;
+}
+
+#endif
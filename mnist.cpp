@@ -23,19 +23,27 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <functional>
+#include <csignal>
 #include "trainer.h"
-
-int reserve_count = 0;
-
-unsigned char from_digits(const char *c, int length)
-{
-    unsigned char b = 0;
-    for (int i = 0; i < length && i < 3; ++i) {
-        b *= 10;
-        b += c[i] - '0';
-    }
-    return b;
-}
+#include "network.h"
+#include "dataset.h"
+#include "evaluate.h"
+#include "quantize.h"
+#include "thread_pool.h"
+#include "train.h"
+#include "profile.h"
+#include "server.h"
+#include "stream.h"
+#include "checkpoint.h"
+#include "dispatch.h"
+#include "sweep.h"
+#include "autotune.h"
+#include "monitor.h"
+#include "online.h"
 
 std::string to_hex(unsigned char b)
 {
@@ -53,65 +61,333 @@ std::string to_hex(unsigned char b)
     return s;
 }
 
-std::pair<unsigned char, std::vector<unsigned char>> parse_line(std::string &s)
+std::vector<std::string> split(const std::string &s, char sep)
 {
-    unsigned t = 0;
-    std::vector<unsigned char> v(784);
-    size_t length = s.length();
-    const char *p = s.c_str();
-    const char *b = p, *e = p;
-    while (e - p <= length) {
-        if (*e == ',') {
-            t = from_digits(b, e - b);
-            b = ++e;
-            break;
-        }
-        ++e;
+    std::vector<std::string> v;
+    size_t b = 0, e;
+    while ((e = s.find(sep, b)) != std::string::npos) {
+        v.push_back(s.substr(b, e - b));
+        b = e + 1;
     }
-    int i = 0;
-    while (e - p <= length) {
-        if (e - p == length || *e == ',') {
-            v[i++] = from_digits(b, e - b);
-            b = e + 1;
+    v.push_back(s.substr(b));
+    return v;
+}
+
+bool is_digits(const std::string &s)
+{
+    for (auto c : s) {
+        if (!std::isdigit(c)) {
+            return false;
         }
-        ++e;
     }
-    return std::make_pair(t, v);
+    return true;
+}
+
+// set by a signal to stop the server, which polls it
+volatile sig_atomic_t stop_serving = 0;
+
+void stop_server(int)
+{
+    stop_serving = 1;
 }
 
-int load_data(const char *path, std::vector<std::pair<unsigned char, std::vector<unsigned char>>> &data)
+// builds the network of topology layers learning at rate, prints whether
+// it has fixed or runtime sizes and returns f(network)
+template<typename F>
+int run_network(const std::vector<int> &layers, float rate, F f)
 {
-    std::ifstream is(path, std::ios::in);
-    if (!is.is_open()) {
-        std::cout << "cannot open: " << path << std::endl;
+    if (layers.front() != 784 || layers.back() != 10) {
+        std::cout << "unsupported network: " << topology_name(layers) << ", needs 784 inputs and 10 outputs" << std::endl;
         return -1;
     }
-    int i = 0;
-    std::string line;
-    while (std::getline(is, line)) {
-        if (i >= reserve_count) {
-            data.push_back(parse_line(line));
-            ++i;
+    std::cout << "network: " << topology_name(layers) << (fixed_hidden(layers) ? " fixed" : " dynamic") << std::endl;
+    return with_network(layers, rate, f);
+}
+
+struct serve_model
+{
+    const char *model;
+    const char *path;
+    int maxBatch;
+    int maxWait;
+
+    template<typename T>
+    int operator()(T &tr) const {
+        if (tr.loadModel(model) < 0) {
+            std::cout << "load model failed" << std::endl;
+            return 0;
+        }
+        prediction_server<T> server(tr, maxBatch, maxWait);
+        if (server.open(path) < 0) {
+            return 0;
+        }
+        stop_serving = 0;
+        signal(SIGINT, stop_server);
+        signal(SIGTERM, stop_server);
+        std::cout << "serving " << model << " on " << path << ", max batch " << maxBatch
+                  << ", max wait " << maxWait << "us" << std::endl;
+        server.run(&stop_serving);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        return 0;
+    }
+};
+
+// mnist serve <model> <socket> [max_batch] [max_wait_us], runs until
+// interrupted
+int serve(int argc, char *argv[])
+{
+    if (argc < 4 || argc > 6) {
+        std::cout << "usage:" << std::endl;
+        std::cout << "    " << argv[0] << " serve <model> <socket> [<max_batch>] [<max_wait_us>]" << std::endl;
+        return 0;
+    }
+    int max_batch = 32, max_wait = 200;
+    if (argc > 4) {
+        if (!is_digits(argv[4]) || (max_batch = atoi(argv[4])) <= 0) {
+            std::cout << "invalid max batch: " << argv[4] << std::endl;
+            return 0;
+        }
+    }
+    if (argc > 5) {
+        if (!is_digits(argv[5])) {
+            std::cout << "invalid max wait: " << argv[5] << std::endl;
+            return 0;
+        }
+        max_wait = atoi(argv[5]);
+    }
+    std::vector<int> layers;
+    if (model_topology(argv[2], layers) < 0) {
+        std::cout << "load model failed" << std::endl;
+        return 0;
+    }
+    return run_network(layers, 0.3f, serve_model{argv[2], argv[3], max_batch, max_wait});
+}
+
+struct score_model
+{
+    const char *model;
+    const char *input;
+    const char *output;
+    int batch;
+    bool probs;
+
+    template<typename T>
+    int operator()(T &tr) const {
+        if (tr.loadModel(model) < 0) {
+            std::cout << "load model failed" << std::endl;
+            return 0;
+        }
+        thread_pool pool;
+        stream_scorer<T> scorer(tr, pool, batch, probs);
+        auto bt = std::chrono::system_clock::now();
+        if (scorer.score(input, output) < 0) {
+            return -1;
+        }
+        std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - bt;
+        double secs = elapsed_seconds.count();
+        std::cout << "scored " << scorer.recordsScored() << " records into " << output << ", used " << secs << "sec(s), "
+                  << scorer.recordsScored() / secs << " records/s, " << scorer.bytesRead() / secs / (1 << 20) << "MB/s" << std::endl;
+        if (scorer.malformed() > 0) {
+            std::cout << "malformed rows: " << scorer.malformed() << std::endl;
+        }
+        std::cout << "stages: scoring waited " << scorer.readWaitSeconds() << "sec(s) for reads, writing waited "
+                  << scorer.writeWaitSeconds() << "sec(s) for scores" << std::endl;
+        return 0;
+    }
+};
+
+// mnist score <model> <input> <output> [batch] [probs], streams the
+// records of input through the model into output
+int score(int argc, char *argv[])
+{
+    bool probs = argc > 5 && std::string(argv[argc - 1]) == "probs";
+    int args = probs ? argc - 1 : argc;
+    if (args < 5 || args > 6) {
+        std::cout << "usage:" << std::endl;
+        std::cout << "    " << argv[0] << " score <model> <input> <output> [<batch>] [probs]" << std::endl;
+        return 0;
+    }
+    int batch = 1024;
+    if (args > 5 && (!is_digits(argv[5]) || (batch = atoi(argv[5])) <= 0)) {
+        std::cout << "invalid batch: " << argv[5] << std::endl;
+        return 0;
+    }
+    std::vector<int> layers;
+    if (model_topology(argv[2], layers) < 0) {
+        std::cout << "load model failed" << std::endl;
+        return 0;
+    }
+    return run_network(layers, 0.3f, score_model{argv[2], argv[3], argv[4], batch, probs});
+}
+
+// the batch size, default threads and rate of train for a network of
+// topology layers learning at rate, from the last autotune when mnist.tune
+// is there and was made for the same topology
+train_config tuned_config(const std::vector<int> &layers, float rate)
+{
+    train_config tuned;
+    tuned.layers = topology_name(layers);
+    tuned.batch = 50;
+    tuned.threads = 1;
+    tuned.rate = rate;
+    train_config saved;
+    if (load_config("mnist.tune", saved) == 0) {
+        if (saved.layers == tuned.layers) {
+            tuned = saved;
+            std::cout << "tuned: batch " << tuned.batch << ", threads " << tuned.threads << ", rate " << tuned.rate << std::endl;
         } else {
-            data[i++] = parse_line(line);
+            std::cout << "mnist.tune is for " << saved.layers << ", ignored" << std::endl;
         }
     }
-    is.close();
-    return 0;
+    return tuned;
 }
 
-bool is_digits(std::string &s)
+struct train_model
 {
-    for (auto c : s) {
-        if (!std::isdigit(c)) {
-            return false;
+    const char *input;
+    const char *output;
+    const char *initial;
+    int epochs;
+    size_t window;
+    int threads;
+    int mode;
+
+    template<typename T>
+    int operator()(T &tr) const {
+        if (initial && tr.loadModel(initial) < 0) {
+            std::cout << "load model failed" << std::endl;
+            return 0;
         }
+        train_config tuned = tuned_config(tr.layers(), tr.rate());
+        tr.setRate(tuned.rate);
+        int runs = effective_train_mode(mode, tr.precision());
+        if (runs != mode) {
+            std::cout << "hogwild needs precision fp32, training in " << train_mode_name(runs) << " mode" << std::endl;
+        }
+        window_stream stream(window);
+        if (stream.open(input) < 0) {
+            return -1;
+        }
+        parallel_trainer<T> ptr(tr, threads);
+        size_t trained = 0;
+        bool use_sparse = false;
+        double density = -1;
+        auto bt = std::chrono::system_clock::now();
+        for (int lp = 0; lp < epochs; ++lp) {
+            stream.epoch(lp);
+            size_t windows = 0;
+            while (const dataset *data = stream.next()) {
+                if (density < 0) {
+                    density = pixel_density(*data);
+                    use_sparse = sparse_is_faster(tr, *data, tuned.batch);
+                }
+                // window w of epoch lp is shuffled with seed w * epochs + lp
+                batch_source source(*data, tuned.batch, true, windows++ * epochs);
+                source.setSparse(use_sparse);
+                source.epoch(lp);
+                ptr.epoch(source, runs, [](size_t) {});
+                trained += data->size();
+                std::cout << "loop: " << lp + 1 << " trained: " << trained << std::endl;
+            }
+            if (stream.readFailed()) {
+                std::cout << "cannot read: " << input << std::endl;
+                return -1;
+            }
+        }
+        std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - bt;
+        std::cout << "finished, used " << elapsed_seconds.count() << "sec(s)" << std::endl;
+        std::cout << "threads: " << threads << ", mode: " << train_mode_name(runs) << ", "
+                  << trained / elapsed_seconds.count() << " samples/s" << std::endl;
+        std::cout << "first layer: " << (use_sparse ? "sparse" : "dense") << ", pixel density " << density << std::endl;
+        std::cout << "window: " << window << " records, " << (stream.blockShuffled() ? "block shuffled" : "read in order")
+                  << ", batch " << tuned.batch << ", waited " << stream.waitSeconds() << "sec(s) for reads" << std::endl;
+        if (stream.malformedRows() > 0) {
+            std::cout << "skipped " << stream.malformedRows() << " malformed or unlabeled rows" << std::endl;
+        }
+        std::cout << "memory: peak rss " << peak_rss_mb() << "MB" << std::endl;
+        if (tr.saveModel(output) < 0) {
+            std::cout << "save model failed" << std::endl;
+            return -1;
+        }
+        return 0;
     }
-    return true;
+};
+
+// mnist train <dataset> <model> [epochs] [window] [threads[:sync|hogwild]],
+// trains a network of topology layers at rate, starting from the weights of
+// initial if given, on a dataset file window by window without loading all of it,
+// and saves the model
+int train(int argc, char *argv[], const std::vector<int> &layers, float rate, const char *initial)
+{
+    if (argc < 4 || argc > 7) {
+        std::cout << "usage:" << std::endl;
+        std::cout << "    " << argv[0] << " train <dataset> <model> [<epochs>] [<window>] [<threads>[:sync|hogwild]]" << std::endl;
+        return 0;
+    }
+    int epochs = 1;
+    if (argc > 4 && (!is_digits(argv[4]) || (epochs = atoi(argv[4])) <= 0)) {
+        std::cout << "invalid epochs: " << argv[4] << std::endl;
+        return 0;
+    }
+    size_t window = 65536;
+    if (argc > 5 && (!is_digits(argv[5]) || (window = strtoull(argv[5], nullptr, 10)) == 0)) {
+        std::cout << "invalid window: " << argv[5] << std::endl;
+        return 0;
+    }
+    std::vector<std::string> args = split(argc > 6 ? argv[6] : "1", ':');
+    if (!is_digits(args[0]) || args[0].empty()) {
+        std::cout << "invalid threads: " << args[0] << std::endl;
+        return 0;
+    }
+    int threads = stoi(args[0]);
+    if (threads <= 0) {
+        threads = thread_pool::hardware();
+    }
+    int mode = threads > 1 ? TRAIN_SYNC : TRAIN_SERIAL;
+    if (args.size() > 1) {
+        if (args[1] == "sync") {
+            mode = TRAIN_SYNC;
+        } else if (args[1] == "hogwild") {
+            mode = TRAIN_HOGWILD;
+        } else {
+            std::cout << "invalid mode: " << args[1] << std::endl;
+            return 0;
+        }
+    }
+    return run_network(layers, rate, train_model{argv[2], argv[3], initial, epochs, window, threads, mode});
 }
 
-void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>> &data, trainer<784, 225, 10> &tr)
+template<typename T>
+void interact(const dataset &data, T &tr, thread_pool &pool)
 {
+    std::map<std::pair<int, bool>, double> scaling;
+    bool shuffle = false;
+    int prefetch = 3;
+    int shuffled = 0;
+    typename quantized_of<T>::type qm;
+    bool quantized = false;
+    int sparse = SPARSE_AUTO;
+    double density = pixel_density(data);
+    std::string checkpoint;
+    int checkpoint_batches = 0;
+    double checkpoint_seconds = 60;
+    size_t resume = 0;
+    train_config tuned = tuned_config(tr.layers(), tr.rate());
+    tr.setRate(tuned.rate);
+    // the auto picks timed so far, by batch size and precision
+    std::map<std::pair<int, int>, bool> sparse_faster;
+    auto pick_sparse = [&]() {
+        if (sparse != SPARSE_AUTO) {
+            return sparse == SPARSE_ON;
+        }
+        auto key = std::make_pair(tuned.batch, tr.precision());
+        if (!sparse_faster.count(key)) {
+            sparse_faster[key] = sparse_is_faster(tr, data, tuned.batch);
+        }
+        return sparse_faster[key];
+    };
+    std::unique_ptr<online_learner<T>> online;
     std::string s;
     while (true) {
         std::cout << "#> ";
@@ -121,10 +397,38 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
             std::cout << "    ?, h, help          show this help" << std::endl;
             std::cout << "    q, quit, exit       exit program" << std::endl;
             std::cout << "    <num>               view data at index <num>" << std::endl;
-            std::cout << "    p[:]<num>           predict data at index <num>" << std::endl;
-            std::cout << "    auc[:]<count>       evaluate accuracy use <count> records" << std::endl;
-            std::cout << "    train[:]<loop>      train <loop>s use loaded dataset" << std::endl;
-            std::cout << "    save[:]<file>       save model to <file>" << std::endl;
+            std::cout << "    p[:]<num>[:int8]    predict data at index <num>" << std::endl;
+            std::cout << "    auc[:]<count>[:int8]" << std::endl;
+            std::cout << "                        evaluate accuracy use <count> records" << std::endl;
+            std::cout << "    train[:]<loop>[:<threads>[:sync|hogwild]]" << std::endl;
+            std::cout << "                        train <loop>s use loaded dataset" << std::endl;
+            std::cout << "    shuffle[:]<on|off>  visit records in a new order every epoch" << std::endl;
+            std::cout << "    sparse[:]<auto|on|off>" << std::endl;
+            std::cout << "                        skip zero pixels in the first layer when training" << std::endl;
+            std::cout << "    prefetch[:]<depth>  batches staged ahead on a thread, 0 for inline" << std::endl;
+            std::cout << "    checkpoint[:]<file>[:<batches>|<seconds>s]" << std::endl;
+            std::cout << "                        checkpoint while training, off to stop" << std::endl;
+            std::cout << "    resume[:]<file>     load a checkpoint, train continues where it was" << std::endl;
+            std::cout << "    sweep[:]<rates>[:<hidden>[:<loop>[:<threads>[:<file>]]]]" << std::endl;
+            std::cout << "                        train a network per rate and hidden sizes at once," << std::endl;
+            std::cout << "                        rank them on held out data, save the best to <file>" << std::endl;
+            std::cout << "    target[:]<accuracy>[:<seconds>[:<threads>[:<file>]]]" << std::endl;
+            std::cout << "                        train until held out data scores <accuracy> or for" << std::endl;
+            std::cout << "                        <seconds>, save the first model scoring it to <file>" << std::endl;
+            std::cout << "    autotune[:<seconds>[:<file>]]" << std::endl;
+            std::cout << "                        time batch sizes, threads and rates, train with the best," << std::endl;
+            std::cout << "                        saved to <file>, mnist.tune by default" << std::endl;
+            std::cout << "    online[:]<file>[:<replay>]" << std::endl;
+            std::cout << "                        train on the records appended to <file> on a thread," << std::endl;
+            std::cout << "                        with <replay> older ones, p and auc use the latest" << std::endl;
+            std::cout << "    online[:stop]       show or stop online learning" << std::endl;
+            std::cout << "    stats[:reset]       show or clear the per phase profile counters" << std::endl;
+            std::cout << "    act[:]<kernel>      sigmoid kernel: eigen, simd or fast" << std::endl;
+            std::cout << "    precision[:]<fp32|bf16|fp16>" << std::endl;
+            std::cout << "                        store weights in half, update in fp32" << std::endl;
+            std::cout << "    save[:]<file>[:bf16|fp16]" << std::endl;
+            std::cout << "                        save model to <file>, binary if it ends with .bin," << std::endl;
+            std::cout << "                        with half weights if given" << std::endl;
             std::cout << "    load[:]<file>       load model from <file>" << std::endl;
             continue;
         }
@@ -133,6 +437,57 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
             s == "exit") {
             break;
         }
+        // the weights belong to the online learner while it runs
+        if (online && (s.substr(0, 4) == "load" || s.substr(0, 4) == "save" || s.substr(0, 5) == "train" ||
+                       s.substr(0, 6) == "target" || s.substr(0, 6) == "resume" || s.substr(0, 8) == "autotune" ||
+                       s.substr(0, 3) == "act" || s.substr(0, 9) == "precision")) {
+            std::cout << "online learning from " << online->path() << ", stop it first" << std::endl;
+            continue;
+        }
+        if (s.substr(0, 6) == "online") {
+            s = s.substr(6);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (s.empty() || s == "stop") {
+                if (!online) {
+                    std::cout << "online: off" << std::endl;
+                    continue;
+                }
+                if (s == "stop") {
+                    online->stop();
+                }
+                online->print(std::cout);
+                if (online->readFailed()) {
+                    std::cout << "cannot read: " << online->path() << std::endl;
+                }
+                if (s == "stop") {
+                    online.reset();
+                    quantized = false;
+                    std::cout << "online: stopped" << std::endl;
+                }
+                continue;
+            }
+            if (online) {
+                std::cout << "online learning from " << online->path() << ", stop it first" << std::endl;
+                continue;
+            }
+            std::vector<std::string> args = split(s, ':');
+            size_t replay = 0;
+            if (args.size() > 1 && (!is_digits(args[1]) || args[1].empty())) {
+                std::cout << "invalid replay: " << args[1] << std::endl;
+                continue;
+            } else if (args.size() > 1) {
+                replay = strtoull(args[1].c_str(), nullptr, 10);
+            }
+            online.reset(new online_learner<T>(tr, tuned.batch, replay));
+            if (online->start(args[0].c_str()) < 0) {
+                online.reset();
+                continue;
+            }
+            std::cout << "online: " << args[0] << ", batch " << tuned.batch << ", replay " << replay << std::endl;
+            continue;
+        }
         if (s.substr(0, 4) == "load") {
             s = s.substr(4);
             if (!s.empty() && s[0] == ':') {
@@ -142,10 +497,13 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
                 std::cout << "no file path" << std::endl;
                 continue;
             }
+            auto bt = std::chrono::system_clock::now();
             if (tr.loadModel(s.c_str()) < 0) {
                 std::cout << "cannot load: " << s << std::endl;
             } else {
-                std::cout << "loaded" << std::endl;
+                std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - bt;
+                std::cout << "loaded, used " << elapsed_seconds.count() << "sec(s)" << std::endl;
+                quantized = false;
             }
             continue;
         }
@@ -154,14 +512,26 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
             if (!s.empty() && s[0] == ':') {
                 s = s.substr(1);
             }
+            int dtype = MODEL_F32;
+            size_t colon = s.rfind(':');
+            if (colon != std::string::npos && parse_precision(s.substr(colon + 1)) >= 0) {
+                dtype = parse_precision(s.substr(colon + 1));
+                s = s.substr(0, colon);
+            }
             if (s.empty()) {
                 std::cout << "no file path" << std::endl;
                 continue;
             }
-            if (tr.saveModel(s.c_str()) < 0) {
+            if (dtype != MODEL_F32 && !is_binary_model_path(s.c_str())) {
+                std::cout << "half models are binary, the path must end with .bin" << std::endl;
+                continue;
+            }
+            auto bt = std::chrono::system_clock::now();
+            if (tr.saveModel(s.c_str(), dtype) < 0) {
                 std::cout << "cannot save: " << s << std::endl;
             } else {
-                std::cout << "saved" << std::endl;
+                std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - bt;
+                std::cout << "saved, used " << elapsed_seconds.count() << "sec(s)" << std::endl;
             }
             continue;
         }
@@ -170,52 +540,461 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
             if (!s.empty() && s[0] == ':') {
                 s = s.substr(1);
             }
+            std::vector<std::string> args = split(s, ':');
             int epochs = 1;
-            if (!s.empty()) {
-                if (!is_digits(s)) {
-                    std::cout << "invalid epochs: " << s << std::endl;
+            if (!args[0].empty()) {
+                if (!is_digits(args[0])) {
+                    std::cout << "invalid epochs: " << args[0] << std::endl;
                     continue;
                 }
-                epochs = stoi(s);
+                epochs = stoi(args[0]);
                 if (epochs <= 0) {
                     std::cout << "epochs: " << epochs << " too small, set to 1" << std::endl;
                     epochs = 1;
                 }
             }
+            int threads = tuned.threads;
+            if (args.size() > 1) {
+                if (!is_digits(args[1]) || args[1].empty()) {
+                    std::cout << "invalid threads: " << args[1] << std::endl;
+                    continue;
+                }
+                threads = stoi(args[1]);
+                if (threads <= 0) {
+                    threads = thread_pool::hardware();
+                }
+            }
+            int mode = threads > 1 ? TRAIN_SYNC : TRAIN_SERIAL;
+            if (args.size() > 2) {
+                if (args[2] == "sync") {
+                    mode = TRAIN_SYNC;
+                } else if (args[2] == "hogwild") {
+                    mode = TRAIN_HOGWILD;
+                } else {
+                    std::cout << "invalid mode: " << args[2] << std::endl;
+                    continue;
+                }
+            }
+            int runs = effective_train_mode(mode, tr.precision());
+            if (runs != mode) {
+                std::cout << "hogwild needs precision fp32, training in " << train_mode_name(runs) << " mode" << std::endl;
+                mode = runs;
+            }
             auto bt = std::chrono::system_clock::now();
-            const int Batch = 50;
-            Matrix<float, Dynamic, 784> m = Matrix<float, Dynamic, 784>::Random(Batch, 784);
-            Matrix<float, Dynamic, 10> t = Matrix<float, Dynamic, 10>::Random(Batch, 10);
-            for (int lp = 0; lp < epochs; ++lp) {
-                int i = 0;
-                while (i < data.size()) {
-                    int e = i + Batch;
-                    if (e > data.size()) {
-                        e = data.size();
-                    }
-                    int b = i;
-                    for (; i < e; ++i) {
-                        const auto &p = data[i];
-                        for (int j = 0; j < 784; ++j) {
-                            m(i - b, j) = (p.second[j] * 0.999 / 255) + 0.001;
-                        }
-                        for (int j = 0; j < 10; ++j) {
-                            if (j == p.first) {
-                                t(i - b, j) = 1;
-                            } else {
-                                t(i - b, j) = 0;
-                            }
+            auto progress = [](int lp, size_t i) {
+                if (i % 1000 == 0) {
+                    std::cout << "loop: " << lp + 1 << " trained: " << i << std::endl;
+                }
+            };
+            bool use_sparse = pick_sparse();
+            batch_source source(data, tuned.batch, shuffle);
+            source.setSparse(use_sparse);
+            parallel_trainer<T> ptr(tr, threads);
+            ptr.setPrefetch(prefetch);
+            std::unique_ptr<checkpointer<T>> ck;
+            if (!checkpoint.empty()) {
+                ck.reset(new checkpointer<T>(tr, checkpoint, checkpoint_batches, checkpoint_seconds));
+            }
+            {
+                PROFILE_SCOPE(PROF_TRAIN, data.size() * epochs);
+                for (int lp = 0; lp < epochs; ++lp) {
+                    unsigned seed = shuffled++;
+                    source.epoch(seed);
+                    source.skip(lp == 0 ? resume : 0);
+                    ptr.epoch(source, mode, [&](size_t i) {
+                        progress(lp, i);
+                        if (ck && i < source.records()) {
+                            ck->step(seed, i);
+                        } else if (ck) {
+                            ck->step(seed + 1, 0);
                         }
-                    }
-                    tr.train(m, t);
-                    if (i % 1000 == 0) {
-                        std::cout << "loop: " << lp + 1 << " trained: " << i << std::endl;
-                    }
+                    });
                 }
             }
+            resume = 0;
             auto et = std::chrono::system_clock::now();
             std::chrono::duration<double> elapsed_seconds = et - bt;
+            double rate = data.size() * epochs / elapsed_seconds.count();
             std::cout << "finished, used " << elapsed_seconds.count() << "sec(s)" << std::endl;
+            quantized = false;
+            std::cout << "threads: " << threads << ", mode: " << train_mode_name(mode) << ", " << rate << " samples/s";
+            auto serial = std::make_pair(int(TRAIN_SERIAL), use_sparse);
+            if (mode != TRAIN_SERIAL && scaling.count(serial)) {
+                std::cout << ", " << rate / scaling[serial] << "x serial";
+            }
+            std::cout << std::endl;
+            std::cout << "first layer: " << (use_sparse ? "sparse" : "dense") << ", pixel density " << density;
+            auto dense = std::make_pair(mode, false);
+            if (use_sparse && scaling.count(dense)) {
+                std::cout << ", " << rate / scaling[dense] << "x dense";
+            }
+            std::cout << std::endl;
+            if (mode != TRAIN_HOGWILD) {
+                std::cout << "staging: waited " << ptr.waitSeconds() << "sec(s) for batches";
+                if (prefetch > 0) {
+                    std::cout << ", prefetch depth " << prefetch << " stalled " << ptr.stallSeconds() << "sec(s)";
+                }
+                std::cout << std::endl;
+            }
+            std::cout << "memory: peak rss " << peak_rss_mb() << "MB" << std::endl;
+            if (ck) {
+                if (!ck->saveAndFlush(shuffled, 0)) {
+                    std::cout << "final checkpoint to " << checkpoint << " failed" << std::endl;
+                }
+                std::cout << "checkpoints: " << ck->writtenCount() << " written to " << checkpoint << ", "
+                          << ck->skippedCount() << " skipped, " << ck->failedCount() << " failed, copying took "
+                          << ck->copySeconds() << "sec(s)" << std::endl;
+            }
+            scaling[std::make_pair(mode, use_sparse)] = rate;
+            continue;
+        }
+        if (s.substr(0, 6) == "sparse") {
+            s = s.substr(6);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (s == "auto") {
+                sparse = SPARSE_AUTO;
+            } else if (s == "on") {
+                sparse = SPARSE_ON;
+            } else if (s == "off") {
+                sparse = SPARSE_OFF;
+            } else if (!s.empty()) {
+                std::cout << "invalid sparse: " << s << std::endl;
+                continue;
+            }
+            std::cout << "sparse: " << sparse_mode_name(sparse) << ", pixel density " << density;
+            if (sparse == SPARSE_AUTO) {
+                std::cout << ", auto picks " << (pick_sparse() ? "sparse" : "dense") << " at batch " << tuned.batch;
+            }
+            std::cout << std::endl;
+            continue;
+        }
+        if (s.substr(0, 7) == "shuffle") {
+            s = s.substr(7);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (s == "on") {
+                shuffle = true;
+            } else if (s == "off") {
+                shuffle = false;
+            } else if (!s.empty()) {
+                std::cout << "invalid shuffle: " << s << std::endl;
+                continue;
+            }
+            std::cout << "shuffle: " << (shuffle ? "on" : "off") << std::endl;
+            continue;
+        }
+        if (s.substr(0, 8) == "prefetch") {
+            s = s.substr(8);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (!s.empty()) {
+                if (!is_digits(s)) {
+                    std::cout << "invalid depth: " << s << std::endl;
+                    continue;
+                }
+                prefetch = stoi(s);
+            }
+            std::cout << "prefetch: " << prefetch << std::endl;
+            continue;
+        }
+        if (s.substr(0, 10) == "checkpoint") {
+            s = s.substr(10);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            std::vector<std::string> args = split(s, ':');
+            if (args[0] == "off") {
+                checkpoint.clear();
+            } else if (!args[0].empty()) {
+                int batches = 0;
+                double seconds = 60;
+                if (args.size() > 1) {
+                    std::string every = args[1];
+                    bool secs = !every.empty() && every.back() == 's';
+                    if (secs) {
+                        every.pop_back();
+                    }
+                    if (every.empty() || !is_digits(every) || stoi(every) <= 0) {
+                        std::cout << "invalid interval: " << args[1] << std::endl;
+                        continue;
+                    }
+                    batches = secs ? 0 : stoi(every);
+                    seconds = secs ? stoi(every) : 0;
+                }
+                checkpoint = args[0];
+                checkpoint_batches = batches;
+                checkpoint_seconds = seconds;
+            }
+            if (checkpoint.empty()) {
+                std::cout << "checkpoint: off" << std::endl;
+            } else if (checkpoint_batches > 0) {
+                std::cout << "checkpoint: " << checkpoint << " every " << checkpoint_batches << " batches" << std::endl;
+            } else {
+                std::cout << "checkpoint: " << checkpoint << " every " << checkpoint_seconds << "sec(s)" << std::endl;
+            }
+            continue;
+        }
+        if (s.substr(0, 6) == "resume") {
+            s = s.substr(6);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            uint32_t epoch;
+            uint64_t trained;
+            if (model_position(s.c_str(), epoch, trained) < 0 || tr.loadModel(s.c_str()) < 0) {
+                std::cout << "cannot resume from: " << s << std::endl;
+                continue;
+            }
+            quantized = false;
+            shuffled = epoch;
+            // the position is in records, so the batch size may differ
+            // from the one the checkpoint was taken with
+            resume = trained;
+            std::cout << "resumed, epoch " << epoch << ", " << resume << " records trained" << std::endl;
+            continue;
+        }
+        if (s.substr(0, 5) == "sweep") {
+            s = s.substr(5);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            std::vector<std::string> args = split(s, ':');
+            std::vector<float> rates;
+            for (auto &r : split(args[0], ',')) {
+                float rate = r.empty() ? 0 : atof(r.c_str());
+                if (rate <= 0) {
+                    std::cout << "invalid rate: " << r << std::endl;
+                    rates.clear();
+                    break;
+                }
+                rates.push_back(rate);
+            }
+            if (rates.empty()) {
+                continue;
+            }
+            // hidden sizes like 100,225,256x128, the current ones by default
+            std::vector<std::vector<int>> shapes;
+            if (args.size() > 1 && !args[1].empty()) {
+                for (auto &h : split(args[1], ',')) {
+                    std::vector<int> layers;
+                    std::string sizes = "784," + h + ",10";
+                    std::replace(sizes.begin(), sizes.end(), 'x', ',');
+                    if (parse_topology(sizes, layers) < 0) {
+                        std::cout << "invalid hidden: " << h << std::endl;
+                        shapes.clear();
+                        break;
+                    }
+                    shapes.push_back(layers);
+                }
+                if (shapes.empty()) {
+                    continue;
+                }
+            } else {
+                shapes.push_back(tr.layers());
+            }
+            int epochs = 1;
+            if (args.size() > 2 && (!is_digits(args[2]) || (epochs = atoi(args[2].c_str())) <= 0)) {
+                std::cout << "invalid epochs: " << args[2] << std::endl;
+                continue;
+            }
+            int threads = 0;
+            if (args.size() > 3 && !is_digits(args[3])) {
+                std::cout << "invalid threads: " << args[3] << std::endl;
+                continue;
+            } else if (args.size() > 3) {
+                threads = atoi(args[3].c_str());
+            }
+            std::string path = args.size() > 4 ? args[4] : "";
+            size_t holdout = data.size() / 10 > 0 ? data.size() / 10 : 1;
+            if (data.size() <= holdout) {
+                std::cout << "too few records: " << data.size() << std::endl;
+                continue;
+            }
+            sweeper sw(data, holdout, epochs, threads);
+            for (auto &layers : shapes) {
+                for (float rate : rates) {
+                    sw.add(layers, rate);
+                }
+            }
+            std::cout << "sweep: " << shapes.size() * rates.size() << " networks on " << sw.threads() << " threads, "
+                      << sw.trainRecords() << " records to train, " << sw.heldRecords() << " held out" << std::endl;
+            int ret = sw.run(path);
+            sw.print(std::cout);
+            std::cout << "swept, used " << sw.seconds() << "sec(s), " << sw.concurrency() << " networks trained at once" << std::endl;
+            if (ret == 0 && !path.empty()) {
+                const sweep_result &r = sw.ranked()[0];
+                std::cout << "best: " << topology_name(r.layers) << " rate " << r.rate << " saved to " << path << std::endl;
+            }
+            continue;
+        }
+        if (s.substr(0, 6) == "target") {
+            s = s.substr(6);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            std::vector<std::string> args = split(s, ':');
+            double target = args[0].empty() ? 0 : atof(args[0].c_str());
+            if (target <= 0 || target > 1) {
+                std::cout << "invalid accuracy: " << args[0] << std::endl;
+                continue;
+            }
+            double budget = 60;
+            if (args.size() > 1 && (budget = atof(args[1].c_str())) <= 0) {
+                std::cout << "invalid seconds: " << args[1] << std::endl;
+                continue;
+            }
+            int threads = tuned.threads;
+            if (args.size() > 2) {
+                if (!is_digits(args[2]) || args[2].empty()) {
+                    std::cout << "invalid threads: " << args[2] << std::endl;
+                    continue;
+                }
+                threads = stoi(args[2]);
+                if (threads <= 0) {
+                    threads = thread_pool::hardware();
+                }
+            }
+            std::string path = args.size() > 3 ? args[3] : "";
+            // the last 10% are held out like in sweep, scored every 0.1sec(s)
+            size_t holdout = data.size() / 10 > 0 ? data.size() / 10 : 1;
+            if (data.size() <= holdout) {
+                std::cout << "too few records: " << data.size() << std::endl;
+                continue;
+            }
+            dataset part, held;
+            part.view(data.labels(), data.pixels(0), data.size() - holdout);
+            held.view(data.labels() + part.size(), data.pixels(part.size()), holdout);
+            int mode = threads > 1 ? TRAIN_SYNC : TRAIN_SERIAL;
+            bool use_sparse = pick_sparse();
+            batch_source source(part, tuned.batch, shuffle);
+            source.setSparse(use_sparse);
+            parallel_trainer<T> ptr(tr, threads);
+            ptr.setPrefetch(prefetch);
+            accuracy_monitor<T> mon(tr, held, target, 0.1, path);
+            std::cout << "training to accuracy " << target << " in " << budget << "sec(s), " << part.size()
+                      << " records to train, " << held.size() << " held out" << std::endl;
+            size_t trained = 0, epoch_trained = 0;
+            auto bt = std::chrono::steady_clock::now();
+            double secs = 0;
+            mon.offer(0, 0);
+            while (!ptr.interrupted()) {
+                source.epoch(shuffled++);
+                epoch_trained = 0;
+                ptr.epoch(source, mode, [&](size_t i) {
+                    epoch_trained = i;
+                    secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+                    mon.offer(secs, trained + i);
+                    if (mon.reached() || secs >= budget) {
+                        ptr.interrupt();
+                    }
+                });
+                trained += epoch_trained;
+            }
+            mon.finish(secs, trained);
+            quantized = false;
+            if (mon.reached()) {
+                accuracy_point p = mon.reachedAt();
+                std::cout << "reached " << p.accuracy << " after " << p.seconds << "sec(s), " << p.trained << " records trained";
+                if (!path.empty() && !mon.saveFailed()) {
+                    std::cout << ", saved to " << path;
+                }
+                std::cout << std::endl;
+                if (mon.saveFailed()) {
+                    std::cout << "cannot save: " << path << std::endl;
+                }
+            } else {
+                std::cout << "not reached " << target << " in " << secs << "sec(s), accuracy " << mon.curve().back().accuracy << std::endl;
+            }
+            std::cout << "trained " << trained << " records in " << secs << "sec(s), " << trained / secs
+                      << " samples/s, evaluated for " << mon.evaluateSeconds() << "sec(s) on another thread" << std::endl;
+            continue;
+        }
+        if (s.substr(0, 8) == "autotune") {
+            s = s.substr(8);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            std::vector<std::string> args = split(s, ':');
+            double seconds = 0.5;
+            if (!args[0].empty() && (seconds = atof(args[0].c_str())) <= 0) {
+                std::cout << "invalid seconds: " << args[0] << std::endl;
+                continue;
+            }
+            std::string path = args.size() > 1 && !args[1].empty() ? args[1] : "mnist.tune";
+            bool use_sparse = pick_sparse();
+            auto bt = std::chrono::system_clock::now();
+            autotuner<T> at(tr, data, use_sparse, seconds);
+            at.run();
+            at.print(std::cout);
+            std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - bt;
+            const tune_result &r = at.chosen();
+            tuned.batch = r.batch;
+            tuned.threads = r.threads;
+            tuned.rate = r.rate;
+            tr.setRate(r.rate);
+            std::cout << "tuned, used " << elapsed_seconds.count() << "sec(s): batch " << r.batch << ", threads "
+                      << r.threads << ", rate " << r.rate << std::endl;
+            if (save_config(path.c_str(), tuned) < 0) {
+                std::cout << "cannot save: " << path << std::endl;
+            }
+            continue;
+        }
+        if (s.substr(0, 5) == "stats") {
+            s = s.substr(5);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (!PROFILE_ENABLED) {
+                std::cout << "profiling is off, build with: make profile" << std::endl;
+            } else if (s == "reset") {
+                profile_reset();
+                std::cout << "stats reset" << std::endl;
+            } else if (!s.empty()) {
+                std::cout << "invalid stats: " << s << std::endl;
+            } else {
+                profile_print(std::cout);
+            }
+            continue;
+        }
+        if (s.substr(0, 3) == "act") {
+            s = s.substr(3);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (s == "eigen") {
+                tr.setActivation(ACT_EIGEN);
+            } else if (s == "simd") {
+                tr.setActivation(ACT_SIMD);
+            } else if (s == "fast") {
+                tr.setActivation(ACT_FAST);
+            } else if (!s.empty()) {
+                std::cout << "invalid activation: " << s << std::endl;
+                continue;
+            }
+            std::cout << "activation: " << activation_name(tr.activation()) << std::endl;
+            for (int a = ACT_EIGEN; a <= ACT_FAST; ++a) {
+                std::cout << "    " << activation_name(a) << " max error: " << sigmoid_max_error(a) << std::endl;
+            }
+            continue;
+        }
+        if (s.substr(0, 9) == "precision") {
+            s = s.substr(9);
+            if (!s.empty() && s[0] == ':') {
+                s = s.substr(1);
+            }
+            if (!s.empty() && parse_precision(s) < 0) {
+                std::cout << "invalid precision: " << s << std::endl;
+                continue;
+            }
+            if (!s.empty()) {
+                tr.setPrecision(parse_precision(s));
+                quantized = false;
+            }
+            std::cout << "precision: " << precision_name(tr.precision()) << ", master weights fp32" << std::endl;
             continue;
         }
         if (s.substr(0, 3) == "auc") {
@@ -223,6 +1002,21 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
             if (!s.empty() && s[0] == ':') {
                 s = s.substr(1);
             }
+            std::vector<std::string> args = split(s, ':');
+            bool int8 = args.back() == "int8";
+            if (int8) {
+                args.pop_back();
+            }
+            if (int8 && !qm.available()) {
+                std::cout << "no int8 model for " << topology_name(tr.layers()) << std::endl;
+                continue;
+            }
+            std::shared_ptr<const T> live = online ? online->model() : nullptr;
+            const T &model = live ? *live : tr;
+            if (live) {
+                quantized = false;
+            }
+            s = args.empty() ? "" : args[0];
             int count = data.size();
             if (!s.empty()) {
                 if (!is_digits(s)) {
@@ -231,30 +1025,62 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
                 }
                 count = stoi(s);
             }
-            if (count <= 0 || count > data.size()) {
+            if (count <= 0 || size_t(count) > data.size()) {
                 count = data.size();
                 std::cout << "set count to: " << count << std::endl;
             }
-            float success = 0;
-            Matrix<float, Dynamic, 784> m = Matrix<float, Dynamic, 784>::Random(1, 784);
-            for (int i = 0; i < count; ++i) {
-                const auto &p = data[i];
-                for (int i = 0; i < 784; ++i) {
-                    m(0, i) = p.second[i];
-                }
-                auto pred = tr.predict(m);
-                int pi = 0;
-                int cols = pred.cols();
-                for (int j = 1; j < cols; ++j) {
-                    if (pred(0, j) > pred(0, pi)) {
-                        pi = j;
-                    }
-                }
-                if (pi == p.first) {
-                    success += 1.0f;
+            auto bt = std::chrono::system_clock::now();
+            evaluation ev;
+            {
+                PROFILE_SCOPE(PROF_SCORE, count);
+                ev = evaluate(model, data, count, pool);
+            }
+            auto et = std::chrono::system_clock::now();
+            std::chrono::duration<double> elapsed_seconds = et - bt;
+            if (!int8) {
+                std::cout << "auc: " << ev.accuracy() << std::endl;
+                ev.print(std::cout);
+                std::cout << "evaluated, used " << elapsed_seconds.count() << "sec(s), "
+                          << count / elapsed_seconds.count() << " records/s" << std::endl;
+                if (model.precision() != PREC_FP32) {
+                    // the master weights scored in fp32
+                    std::unique_ptr<T> full(model.clone());
+                    full->setPrecision(PREC_FP32);
+                    bt = std::chrono::system_clock::now();
+                    evaluation fev = evaluate(*full, data, count, pool);
+                    std::chrono::duration<double> fs = std::chrono::system_clock::now() - bt;
+                    std::cout << "fp32 auc: " << fev.accuracy() << ", " << precision_name(model.precision()) << " auc: "
+                              << ev.accuracy() << ", delta: " << ev.accuracy() - fev.accuracy() << std::endl;
+                    std::cout << "fp32: " << count / fs.count() << " records/s, " << precision_name(model.precision()) << ": "
+                              << count / elapsed_seconds.count() << " records/s" << std::endl;
                 }
+                continue;
+            }
+            if (!quantized) {
+                bt = std::chrono::system_clock::now();
+                qm.quantize(model, data);
+                quantized = true;
+                std::chrono::duration<double> qs = std::chrono::system_clock::now() - bt;
+                std::cout << "quantized, used " << qs.count() << "sec(s)" << std::endl;
             }
-            std::cout << "auc: " << (success / count) << std::endl;
+            bt = std::chrono::system_clock::now();
+            evaluation qev;
+            {
+                PROFILE_SCOPE(PROF_SCORE, count);
+                qev = evaluate(qm, data, count, pool);
+            }
+            std::chrono::duration<double> qs = std::chrono::system_clock::now() - bt;
+            std::cout << "auc: " << qev.accuracy() << std::endl;
+            qev.print(std::cout);
+            std::cout << "evaluated, used " << qs.count() << "sec(s), "
+                      << count / qs.count() << " records/s" << std::endl;
+            std::cout << "float auc: " << ev.accuracy() << ", int8 auc: " << qev.accuracy()
+                      << ", delta: " << qev.accuracy() - ev.accuracy() << std::endl;
+            std::cout << "float: " << count / elapsed_seconds.count() << " records/s, int8 (" << int8_kernel_name() << "): "
+                      << count / qs.count() << " records/s, " << elapsed_seconds.count() / qs.count() << "x" << std::endl;
+            size_t fbytes = sizeof(float) * tr.parameters();
+            std::cout << "model: " << fbytes << " bytes float, " << qm.bytes() << " bytes int8, "
+                      << double(fbytes) / qm.bytes() << "x smaller" << std::endl;
             continue;
         }
         if (s[0] == 'p') {
@@ -262,22 +1088,36 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
             if (!s.empty() && s[0] == ':') {
                 s = s.substr(1);
             }
-            if (s.empty()) {
+            bool int8 = s.size() > 5 && s.substr(s.size() - 5) == ":int8";
+            if (int8) {
+                s = s.substr(0, s.size() - 5);
+            }
+            if (int8 && !qm.available()) {
+                std::cout << "no int8 model for " << topology_name(tr.layers()) << std::endl;
+            } else if (s.empty()) {
                 std::cout << "missing index" << std::endl;
             } else if (!is_digits(s)) {
                 std::cout << "invalid index: " << s << std::endl;
             } else {
                 int i = stoi(s);
-                if (i < 0 &&
-                    i >= data.size()) {
+                if (i < 0 ||
+                    size_t(i) >= data.size()) {
                     std::cout << "invalid index: " << s << std::endl;
                 } else {
-                    const auto &p = data[i];
-                    Matrix<float, Dynamic, 784> m = Matrix<float, Dynamic, 784>::Random(1, 784);
-                    for (int i = 0; i < 784; ++i) {
-                        m(0, i) = p.second[i];
+                    Matrix<float, Dynamic, 10> pred;
+                    std::shared_ptr<const T> live = online ? online->model() : nullptr;
+                    const T &model = live ? *live : tr;
+                    if (int8) {
+                        if (!quantized || live) {
+                            qm.quantize(model, data);
+                            quantized = !live;
+                        }
+                        qm.predict(data.pixels(i), 1, pred);
+                    } else {
+                        Matrix<float, Dynamic, 784, RowMajor> m(1, 784);
+                        convert_pixels(data.pixels(i), m.data(), 784);
+                        model.predict(m, pred);
                     }
-                    auto pred = tr.predict(m);
                     std::stringstream ss;
                     int pn = 0;
                     for (int i = 0; i < 10; ++i) {
@@ -287,7 +1127,7 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
                         }
                         ss << i << ": " << p << std::endl;
                     }
-                    std::cout << i << " target: " << int(p.first) << ", predict: " << pn << std::endl;
+                    std::cout << i << " target: " << int(data.label(i)) << ", predict: " << pn << std::endl;
                     std::cout << ss.str();
                 }
             }
@@ -299,12 +1139,12 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
         }
         int i = stoi(s);
         if (i >= 0 &&
-            i < data.size()) {
-            const auto &p = data[i];
-            std::cout << i << " target: " << int(p.first) << std::endl;
+            size_t(i) < data.size()) {
+            const unsigned char *px = data.pixels(i);
+            std::cout << i << " target: " << int(data.label(i)) << std::endl;
             for (int l = 0; l < 28; ++l) {
                 for (int c = 0; c < 28; ++c) {
-                    std::cout << to_hex(p.second[l * 28 + c]);
+                    std::cout << to_hex(px[l * 28 + c]);
                 }
                 std::cout << std::endl;
             }
@@ -314,38 +1154,114 @@ void interact(std::vector<std::pair<unsigned char, std::vector<unsigned char>>>
     }
 }
 
-int main(int argc, char *argv[])
+struct interact_model
 {
-    if (argc < 2) {
-        std::cout << "usage:" << std::endl;
-        std::cout << "    " << argv[0] << " <path_to_mnist_csv> [record_count_hint]" << std::endl;
+    const dataset &data;
+    thread_pool &pool;
+    const char *initial;
+
+    template<typename T>
+    int operator()(T &tr) const {
+        if (initial && tr.loadModel(initial) < 0) {
+            std::cout << "load model failed" << std::endl;
+            return 0;
+        }
+        interact(data, tr, pool);
         return 0;
-    } else if (argc == 3) {
-        std::string cs = argv[2];
-        if (is_digits(cs)) {
-            reserve_count = stoi(cs);
-            if (reserve_count < 0 ||
-                reserve_count > 10000000) {
-                std::cout << "reserve count too large: " << reserve_count << std::endl;
+    }
+};
+
+// make builds this file once per isa level, see dispatch.h
+#ifdef MNIST_ISA
+extern "C" int ISA_MAIN(mnist, MNIST_ISA)(int argc, char *argv[])
+#else
+int main(int argc, char *argv[])
+#endif
+{
+    // --layers=<sizes>, --rate=<lrate> and --model=<file> come first, the
+    // topology of the model is used when there is one
+    std::vector<int> layers{784, 225, 10};
+    float rate = 0.3f;
+    const char *initial = nullptr;
+    int opts = 1;
+    for (; opts < argc && std::string(argv[opts]).substr(0, 2) == "--"; ++opts) {
+        std::string opt = argv[opts];
+        if (opt.substr(0, 9) == "--layers=") {
+            if (parse_topology(opt.substr(9), layers) < 0) {
+                std::cout << "invalid layers: " << opt.substr(9) << std::endl;
+                return 0;
+            }
+        } else if (opt.substr(0, 7) == "--rate=") {
+            rate = atof(opt.c_str() + 7);
+            if (rate <= 0) {
+                std::cout << "invalid rate: " << opt.substr(7) << std::endl;
+                return 0;
+            }
+        } else if (opt.substr(0, 8) == "--model=") {
+            initial = argv[opts] + 8;
+        } else if (opt.substr(0, 6) == "--isa=") {
+            // only seen by a build for one level
+            if (parse_isa(opt.substr(6)) != compiled_isa()) {
+                std::cout << "built for " << isa_name(compiled_isa()) << " only" << std::endl;
                 return 0;
             }
+        } else {
+            std::cout << "invalid option: " << opt << std::endl;
+            return 0;
         }
-    } else if (argc > 3) {
+    }
+    if (initial) {
+        std::vector<int> v;
+        if (model_topology(initial, v) < 0) {
+            std::cout << "load model failed" << std::endl;
+            return 0;
+        }
+        layers = v;
+    }
+    argv[opts - 1] = argv[0];
+    argv += opts - 1;
+    argc -= opts - 1;
+    std::cout << "isa: " << isa_name(compiled_isa()) << ", cpu supports " << isa_name(cpu_isa()) << std::endl;
+    if (argc > 1 && std::string(argv[1]) == "serve") {
+        return serve(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "score") {
+        return score(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "train") {
+        return train(argc, argv, layers, rate, initial);
+    }
+    if (argc < 2) {
+        std::cout << "usage:" << std::endl;
+        std::cout << "    " << argv[0] << " [--isa=sse2|avx2|avx512] [--layers=784,<hidden>,...,10] [--rate=<lrate>] [--model=<file>] <path_to_mnist_csv> [record_count_hint]" << std::endl;
+        std::cout << "    " << argv[0] << " serve <model> <socket> [<max_batch>] [<max_wait_us>]" << std::endl;
+        std::cout << "    " << argv[0] << " score <model> <input> <output> [<batch>] [probs]" << std::endl;
+        std::cout << "    " << argv[0] << " [--layers=...] [--rate=...] [--model=<file>] train <dataset> <model> [<epochs>] [<window>] [<threads>[:sync|hogwild]]" << std::endl;
+        return 0;
+    } else if (argc > 3 || (argc == 3 && !is_digits(argv[2]))) {
+        // a record count hint may follow the path, it's not needed anymore
+        // since records are counted before parsing
         std::cout << "too many params" << std::endl;
         return 0;
     }
     auto start = std::chrono::system_clock::now();
-    std::vector<std::pair<unsigned char, std::vector<unsigned char>>> train_data(reserve_count);
-    if (load_data(argv[1], train_data) < 0) {
+    dataset train_data;
+    if (train_data.load(argv[1]) < 0) {
         std::cout << "load train data failed" << std::endl;
         return 0;
     }
     auto finish = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed_seconds = finish - start;
-    std::cout << "loaded, used " << elapsed_seconds.count() << "sec(s)" << std::endl;
+    double secs = elapsed_seconds.count();
+    // a mapped dataset isn't read up front, a rate would mean nothing
+    std::cout << "loaded, used " << secs << "sec(s), ";
+    if (!train_data.mapped()) {
+        std::cout << train_data.sourceBytes() / secs / (1 << 20) << "MB/s, ";
+    }
+    std::cout << train_data.size() / secs << " records/s" << std::endl;
     std::cout << argv[1] << ": " << train_data.size() << std::endl;
     
-    trainer<784, 225, 10> tr(0.3f);
-    interact(train_data, tr);
+    thread_pool pool;
+    run_network(layers, rate, interact_model{train_data, pool, initial});
     return 0;
 }
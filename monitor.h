@@ -0,0 +1,199 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_MONITOR_H
+#define MNIST_MONITOR_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "dataset.h"
+#include "evaluate.h"
+#include "thread_pool.h"
+
+// accuracy on the held out records after seconds of training and trained
+// records
+struct accuracy_point
+{
+    double seconds;
+    size_t trained;
+    double accuracy;
+};
+
+// scores snapshots of a network on held out records on a background
+// thread while it trains. offer() copies the weights into a replica when
+// the thread is idle and at least every seconds have passed since the
+// last one, and returns at once otherwise, so training never waits for
+// an evaluation. the first snapshot scoring target or more is saved to
+// path unless it's empty, and reached() turns true. T is a trainer or a
+// layer_network
+template<typename T>
+class accuracy_monitor
+{
+public:
+    accuracy_monitor(const T &tr, const dataset &held, double target, double every, const std::string &path) : tr(tr), held(held), replica(tr.clone()), target(target), every(every), path(path), last(-every), busy(false), pending(false), stop(false), hit(false), failed(false), evaluating(0) {
+        evaluator = std::thread(&accuracy_monitor::run, this);
+    }
+
+    accuracy_monitor(const accuracy_monitor &) = delete;
+    accuracy_monitor &operator=(const accuracy_monitor &) = delete;
+
+    ~accuracy_monitor() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stop = true;
+        }
+        cv.notify_one();
+        evaluator.join();
+    }
+
+    // called by the training thread between batches, false when no
+    // snapshot was taken
+    bool offer(double seconds, size_t trained) {
+        if (busy || seconds - last < every) {
+            return false;
+        }
+        take(seconds, trained);
+        return true;
+    }
+
+    // score the weights as they are now unless the last snapshot has them,
+    // waiting for the evaluation under way and for this one
+    void finish(double seconds, size_t trained) {
+        idle();
+        if (seconds != last || trained != current.trained) {
+            take(seconds, trained);
+            idle();
+        }
+    }
+
+    bool reached() const {
+        return hit;
+    }
+
+    // true when the snapshot reaching the target couldn't be saved
+    bool saveFailed() const {
+        return failed;
+    }
+
+    // the accuracy of every snapshot in the order they were taken
+    std::vector<accuracy_point> curve() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return points;
+    }
+
+    // the first snapshot scoring target, when reached()
+    accuracy_point reachedAt() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return first;
+    }
+
+    // seconds the evaluator thread spent scoring
+    double evaluateSeconds() const {
+        return evaluating;
+    }
+
+protected:
+    void take(double seconds, size_t trained) {
+        if (snapshot.empty()) {
+            snapshot.resize(tr.parameters());
+        }
+        tr.snapshot(snapshot.data());
+        replica->restore(snapshot.data());
+        last = seconds;
+        current.seconds = seconds;
+        current.trained = trained;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            busy = true;
+            pending = true;
+        }
+        cv.notify_one();
+    }
+
+    void idle() {
+        std::unique_lock<std::mutex> lk(mtx);
+        done.wait(lk, [this] { return !busy; });
+    }
+
+    void run() {
+        thread_pool serial(1);
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [this] { return stop || pending; });
+                if (!pending) {
+                    return;
+                }
+                pending = false;
+            }
+            auto bt = std::chrono::steady_clock::now();
+            accuracy_point p = current;
+            p.accuracy = evaluate(*replica, held, held.size(), serial).accuracy();
+            evaluating += std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+            std::cout << "  " << p.seconds << "sec(s), " << p.trained << " trained: accuracy " << p.accuracy << std::endl;
+            bool first_hit = !hit && p.accuracy >= target;
+            if (first_hit && !path.empty() && replica->saveModel(path.c_str()) < 0) {
+                failed = true;
+            }
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                points.push_back(p);
+                if (first_hit) {
+                    first = p;
+                    hit = true;
+                }
+                busy = false;
+            }
+            done.notify_all();
+        }
+    }
+
+    const T &tr;
+    const dataset &held;
+    std::unique_ptr<T> replica;
+    double target;
+    double every;
+    std::string path;
+    std::vector<float> snapshot;
+    accuracy_point current;
+    accuracy_point first;
+    std::vector<accuracy_point> points;
+    double last;
+    std::atomic<bool> busy;
+    bool pending;
+    bool stop;
+    std::atomic<bool> hit;
+    std::atomic<bool> failed;
+    double evaluating;
+    std::thread evaluator;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::condition_variable done;
+};
+
+#endif
@@ -0,0 +1,725 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_NETWORK_H
+#define MNIST_NETWORK_H
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <Eigen/Dense>
+#include "kernels.h"
+#include "sparse.h"
+#include "profile.h"
+#include "trainer.h"
+
+// the hidden sizes of the 784-h-10 networks compiled as trainer<784, h, 10>,
+// with fixed size kernels, X(h) is expanded once for each of them. every
+// other topology runs on layer_network
+#define MNIST_FIXED_HIDDEN(X) X(100) X(225)
+
+// version 3 of the binary model, for any number of layers:
+//   [header, 64 bytes][table][pad][w0][pad][w1]...
+// the table is uint32_t count followed by count layer sizes, header.hidden
+// is count and header.ih the offset of w0. every matrix is row major and
+// starts on a 64 byte boundary, the checksum covers them in order. a
+// network with one hidden layer is saved as version 2 instead, so it loads
+// into the matching trainer too
+enum { MODEL_LAYERS_VERSION = 3 };
+
+inline std::string topology_name(const std::vector<int> &layers)
+{
+    std::string s;
+    for (size_t i = 0; i < layers.size(); ++i) {
+        s += (i > 0 ? "x" : "") + std::to_string(layers[i]);
+    }
+    return s;
+}
+
+// "784,300,100,10" into the layer sizes, -1 unless there are at least an
+// input and an output layer, all positive
+inline int parse_topology(const std::string &s, std::vector<int> &layers)
+{
+    std::vector<int> v;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty() || item.find_first_not_of("0123456789") != std::string::npos || atoi(item.c_str()) <= 0) {
+            return -1;
+        }
+        v.push_back(atoi(item.c_str()));
+    }
+    if (v.size() < 2) {
+        return -1;
+    }
+    layers = v;
+    return 0;
+}
+
+// the layer sizes of the model at path, binary or text
+inline int model_topology(const char *path, std::vector<int> &layers)
+{
+    std::ifstream is(path, std::ios::in | std::ios::binary);
+    if (!is.is_open()) {
+        std::cout << "cannot open: " << path << std::endl;
+        return -1;
+    }
+    model_header h;
+    if (is.read(reinterpret_cast<char *>(&h), sizeof(h)) && memcmp(h.magic, "MNISTMD", 8) == 0) {
+        if (h.version < MODEL_LAYERS_VERSION) {
+            layers = std::vector<int>{int(h.input), int(h.hidden), int(h.output)};
+            return 0;
+        }
+        uint32_t count = 0;
+        if (!is.read(reinterpret_cast<char *>(&count), sizeof(count)) || count < 2 || count != h.hidden || count > 1024) {
+            return -1;
+        }
+        std::vector<uint32_t> v(count);
+        if (!is.read(reinterpret_cast<char *>(v.data()), sizeof(uint32_t) * count)) {
+            return -1;
+        }
+        layers.assign(v.begin(), v.end());
+        return 0;
+    }
+    // a text model is a list of "rows,cols" lines each followed by rows rows
+    is.clear();
+    is.seekg(0);
+    std::vector<int> v;
+    std::string line;
+    int rows, cols;
+    while (std::getline(is, line) && parse_dim(line, rows, cols) == 0) {
+        if (v.empty()) {
+            v.push_back(rows);
+        } else if (v.back() != rows) {
+            return -1;
+        }
+        v.push_back(cols);
+        for (int i = 0; i < rows; ++i) {
+            if (!std::getline(is, line)) {
+                return -1;
+            }
+        }
+    }
+    if (v.size() < 2) {
+        return -1;
+    }
+    layers = v;
+    return 0;
+}
+
+// the hidden size of a topology compiled with fixed sizes, 0 for others
+inline int fixed_hidden(const std::vector<int> &layers)
+{
+    if (layers.size() != 3 || layers[0] != 784 || layers[2] != 10) {
+        return 0;
+    }
+#define MNIST_IS_FIXED(H) if (layers[1] == H) return H;
+    MNIST_FIXED_HIDDEN(MNIST_IS_FIXED)
+#undef MNIST_IS_FIXED
+    return 0;
+}
+
+// a stack of fully connected sigmoid layers sized at runtime, the fallback
+// for topologies without a trainer compiled for them. it has the same
+// interface as trainer and trains the same way: the errors of a layer are
+// propagated to the one below before the sigmoid derivative is applied,
+// and a step adds lrate times the summed batch gradient. with a single
+// hidden layer the results equal trainer's, the dynamic sized products
+// are just slower and allocate their gemm buffers
+class layer_network
+{
+public:
+    enum { CHUNK = 128, SPARSE_KERNELS = 0, MODEL_VERSION = 2, MODEL_ALIGN = 64 };
+
+    typedef Matrix<float, Dynamic, Dynamic, RowMajor> matrix;
+
+    struct workspace
+    {
+        // outputs[l] and errors[l] hold the chunk rows of layer l + 1,
+        // grads[l] the gradient of weights[l]
+        std::vector<matrix> outputs;
+        std::vector<matrix> errors;
+        std::vector<matrix> grads;
+        // a chunk of a sparse batch made dense
+        matrix dense;
+        // a panel of half weights widened, in the half precisions
+        std::vector<float> panel;
+
+        void accumulate(const workspace &o, int part, int parts) {
+            for (size_t l = 0; l < grads.size(); ++l) {
+                int rows = grads[l].rows();
+                int b = rows * part / parts, e = rows * (part + 1) / parts;
+                grads[l].middleRows(b, e - b) += o.grads[l].middleRows(b, e - b);
+            }
+        }
+    };
+
+    layer_network(const std::vector<int> &sizes, float lrate) : sizes(sizes), lrate(lrate), act(ACT_SIMD), prec(PREC_FP32) {
+        for (size_t l = 0; l + 1 < sizes.size(); ++l) {
+            weights.push_back(matrix::Random(sizes[l], sizes[l + 1]));
+        }
+        reserve(own);
+    }
+
+    // start over from weights drawn from seed
+    void randomize(unsigned seed) {
+        std::mt19937 rng(seed);
+        for (auto &w : weights) {
+            random_weights(w.data(), w.size(), rng);
+        }
+        refresh();
+    }
+
+    // a new network with the same shape, rate, kernel and weights
+    layer_network *clone() const {
+        layer_network *p = new layer_network(sizes, lrate);
+        p->act = act;
+        p->weights = weights;
+        p->setPrecision(prec);
+        return p;
+    }
+
+    const std::vector<int> &layers() const {
+        return sizes;
+    }
+
+    size_t parameters() const {
+        size_t n = 0;
+        for (auto &w : weights) {
+            n += w.size();
+        }
+        return n;
+    }
+
+    void setActivation(int mode) {
+        act = mode;
+    }
+
+    int activation() const {
+        return act;
+    }
+
+    void setRate(float rate) {
+        lrate = rate;
+    }
+
+    float rate() const {
+        return lrate;
+    }
+
+    // in the half precisions the updates go to weights, the products read
+    // their 16 bit copies in packed
+    void setPrecision(int mode) {
+        prec = mode;
+        refresh();
+    }
+
+    int precision() const {
+        return prec;
+    }
+
+    template<typename D1, typename D2>
+    void train(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets) {
+        gradient(inputs, targets, own);
+        update(own);
+    }
+
+    template<typename D>
+    void train(const sparse_rows &inputs, const MatrixBase<D> &targets) {
+        gradient(inputs, 0, targets, own);
+        update(own);
+    }
+
+    template<typename D1, typename D2>
+    void gradient(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets, workspace &ws) const {
+        reserve(ws);
+        int rows = inputs.rows();
+        for (int b = 0; b < rows || b == 0; b += CHUNK) {
+            int n = rows - b < CHUNK ? rows - b : CHUNK;
+            chunk(inputs.middleRows(b, n), targets.middleRows(b, n), b == 0, ws);
+        }
+    }
+
+    // sparse batches are made dense a chunk at a time, there are no
+    // sparse kernels for runtime sizes
+    template<typename D>
+    void gradient(const sparse_rows &inputs, int first, const MatrixBase<D> &targets, workspace &ws) const {
+        reserve(ws);
+        int rows = targets.rows();
+        for (int b = 0; b < rows || b == 0; b += CHUNK) {
+            int n = rows - b < CHUNK ? rows - b : CHUNK;
+            ws.dense.topRows(n).setConstant(PIXEL_BIAS);
+            for (int i = 0; i < n; ++i) {
+                uint32_t s = inputs.start[first + b + i], e = inputs.start[first + b + i + 1];
+                for (uint32_t k = s; k < e; ++k) {
+                    ws.dense(i, inputs.index[k]) += inputs.value[k];
+                }
+            }
+            chunk(ws.dense.topRows(n), targets.middleRows(b, n), b == 0, ws);
+        }
+    }
+
+    void update(const workspace &ws) {
+        PROFILE_SCOPE(PROF_UPDATE, 0);
+        for (size_t l = 0; l < weights.size(); ++l) {
+            weights[l].noalias() += ws.grads[l] * lrate;
+        }
+        refresh();
+    }
+
+    template<typename D1, typename D2>
+    void trainLockFree(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets, workspace &ws) {
+        gradient(inputs, targets, ws);
+        update(ws);
+    }
+
+    template<typename D>
+    void trainLockFree(const sparse_rows &inputs, const MatrixBase<D> &targets, workspace &ws) {
+        gradient(inputs, 0, targets, ws);
+        update(ws);
+    }
+
+    template<typename D>
+    matrix predict(const MatrixBase<D> &inputs) const {
+        matrix outputs;
+        predict(inputs, outputs);
+        return outputs;
+    }
+
+    template<typename D, typename O>
+    void predict(const MatrixBase<D> &inputs, O &outputs) const {
+        PROFILE_SCOPE(PROF_PREDICT, inputs.rows());
+        std::vector<float> panel(prec == PREC_FP32 ? 0 : HALF_PANEL * widest());
+        matrix x(inputs.rows(), sizes[1]);
+        product(inputs, 0, x, panel.data());
+        activate(x.data(), x.size());
+        for (size_t l = 1; l < weights.size(); ++l) {
+            matrix y(x.rows(), sizes[l + 1]);
+            product(x, l, y, panel.data());
+            activate(y.data(), y.size());
+            x.swap(y);
+        }
+        outputs = x;
+    }
+
+    const matrix &getWeights(int l) const {
+        return weights[l];
+    }
+
+    // the weights in file order, parameters() floats
+    void snapshot(float *p) const {
+        for (size_t l = 0; l < weights.size(); ++l) {
+            if (sizes.size() == 3 && l == 1) {
+                Map<Matrix<float, Dynamic, Dynamic>>(p, weights[l].rows(), weights[l].cols()) = weights[l];
+            } else {
+                memcpy(p, weights[l].data(), sizeof(float) * weights[l].size());
+            }
+            p += weights[l].size();
+        }
+    }
+
+    // put back weights copied out by snapshot
+    void restore(const float *p) {
+        for (size_t l = 0; l < weights.size(); ++l) {
+            if (sizes.size() == 3 && l == 1) {
+                weights[l] = Map<const Matrix<float, Dynamic, Dynamic>>(p, weights[l].rows(), weights[l].cols());
+            } else {
+                memcpy(weights[l].data(), p, sizeof(float) * weights[l].size());
+            }
+            p += weights[l].size();
+        }
+        refresh();
+    }
+
+    // write a snapshot as a binary model through a temporary file, with
+    // the weights stored as dtype
+    int writeSnapshot(const char *path, const float *p, uint32_t epoch, uint64_t trained, int dtype = MODEL_F32) const {
+        if (sizes.size() == 3) {
+            return writeTwoLayer(path, p, epoch, trained, dtype);
+        }
+        model_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MNISTMD", 8);
+        h.version = MODEL_LAYERS_VERSION;
+        h.dtype = dtype;
+        h.input = sizes.front();
+        h.hidden = sizes.size();
+        h.output = sizes.back();
+        h.epoch = epoch;
+        h.trained = trained;
+        h.ih = align(sizeof(h) + sizeof(uint32_t) * (sizes.size() + 1));
+        std::vector<uint64_t> offsets = matrixOffsets(h.ih, model_dtype_size(dtype));
+        std::vector<std::vector<uint16_t>> bufs(weights.size());
+        std::vector<const char *> bytes;
+        uint64_t sum = 14695981039346656037ULL;
+        for (size_t l = 0; l < weights.size(); ++l) {
+            bytes.push_back(model_bytes(p, weights[l].size(), dtype, bufs[l]));
+            sum = model_checksum(bytes[l], model_dtype_size(dtype) * weights[l].size(), sum);
+            p += weights[l].size();
+        }
+        h.checksum = sum;
+        std::string tmp = std::string(path) + ".tmp";
+        std::ofstream os(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!os.is_open()) {
+            std::cout << "cannot open: " << tmp << std::endl;
+            return -1;
+        }
+        os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        std::vector<uint32_t> table(1, sizes.size());
+        table.insert(table.end(), sizes.begin(), sizes.end());
+        os.write(reinterpret_cast<const char *>(table.data()), sizeof(uint32_t) * table.size());
+        uint64_t at = sizeof(h) + sizeof(uint32_t) * table.size();
+        char pad[MODEL_ALIGN] = {0};
+        for (size_t l = 0; l < weights.size(); ++l) {
+            os.write(pad, offsets[l] - at);
+            os.write(bytes[l], model_dtype_size(dtype) * weights[l].size());
+            at = offsets[l] + model_dtype_size(dtype) * weights[l].size();
+        }
+        os.close();
+        if (!os || rename(tmp.c_str(), path) < 0) {
+            unlink(tmp.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    // a path ending with .bin is saved in the binary format, with the
+    // weights stored as dtype, anything else as csv text
+    int saveModel(const char *path, int dtype = MODEL_F32) {
+        if (is_binary_model_path(path)) {
+            std::vector<float> p(parameters());
+            snapshot(p.data());
+            return writeSnapshot(path, p.data(), 0, 0, dtype);
+        }
+        std::ofstream os(path, std::ios::out);
+        if (!os.is_open()) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        closer<std::ofstream> co(os);
+        for (auto &w : weights) {
+            os << w.rows() << ',' << w.cols() << '\n';
+            for (int r = 0; r < w.rows(); ++r) {
+                for (int c = 0; c < w.cols(); ++c) {
+                    if (c > 0) {
+                        os << ',';
+                    }
+                    os << w(r, c);
+                }
+                os << '\n';
+            }
+        }
+        return 0;
+    }
+
+    // the model must have the same topology
+    int loadModel(const char *path) {
+        std::vector<int> v;
+        if (model_topology(path, v) < 0) {
+            return -1;
+        }
+        if (v != sizes) {
+            std::cout << "model is " << topology_name(v) << std::endl;
+            return -1;
+        }
+        if (is_binary_model(path)) {
+            return loadBinary(path);
+        }
+        std::ifstream is(path, std::ios::in);
+        if (!is.is_open()) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        closer<std::ifstream> ci(is);
+        std::vector<matrix> loaded(weights);
+        std::string line;
+        int rows, cols;
+        for (auto &w : loaded) {
+            if (!std::getline(is, line) || parse_dim(line, rows, cols) < 0) {
+                return -1;
+            }
+            for (int r = 0; r < rows; ++r) {
+                std::vector<float> rd;
+                if (!std::getline(is, line) || (rd = parse_weights(line)).size() != size_t(cols)) {
+                    return -1;
+                }
+                w.row(r) = Map<const Matrix<float, 1, Dynamic>>(rd.data(), cols);
+            }
+        }
+        weights.swap(loaded);
+        refresh();
+        return 0;
+    }
+
+protected:
+    static uint64_t align(uint64_t n) {
+        return (n + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+    }
+
+    // where each matrix starts, weights of size bytes each
+    std::vector<uint64_t> matrixOffsets(uint64_t first, size_t size) const {
+        std::vector<uint64_t> offsets;
+        for (auto &w : weights) {
+            offsets.push_back(first);
+            first = align(first + size * w.size());
+        }
+        return offsets;
+    }
+
+    // the version 2 layout of trainer, the second matrix column major
+    int writeTwoLayer(const char *path, const float *p, uint32_t epoch, uint64_t trained, int dtype) const {
+        model_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MNISTMD", 8);
+        h.version = MODEL_VERSION;
+        h.dtype = dtype;
+        h.input = sizes[0];
+        h.hidden = sizes[1];
+        h.output = sizes[2];
+        h.epoch = epoch;
+        h.trained = trained;
+        size_t bih = model_dtype_size(dtype) * weights[0].size(), bho = model_dtype_size(dtype) * weights[1].size();
+        h.ih = sizeof(model_header);
+        h.ho = align(h.ih + bih);
+        std::vector<uint16_t> hih, hho;
+        const char *ih = model_bytes(p, weights[0].size(), dtype, hih);
+        const char *ho = model_bytes(p + weights[0].size(), weights[1].size(), dtype, hho);
+        h.checksum = model_checksum(ho, bho, model_checksum(ih, bih));
+        std::string tmp = std::string(path) + ".tmp";
+        std::ofstream os(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!os.is_open()) {
+            std::cout << "cannot open: " << tmp << std::endl;
+            return -1;
+        }
+        os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        os.write(ih, bih);
+        char pad[MODEL_ALIGN] = {0};
+        os.write(pad, h.ho - h.ih - bih);
+        os.write(ho, bho);
+        os.close();
+        if (!os || rename(tmp.c_str(), path) < 0) {
+            unlink(tmp.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    int loadBinary(const char *path) {
+        std::ifstream is(path, std::ios::in | std::ios::binary);
+        model_header h;
+        if (!is.is_open() || !is.read(reinterpret_cast<char *>(&h), sizeof(h)) || memcmp(h.magic, "MNISTMD", 8) != 0 || h.dtype > MODEL_F16) {
+            return -1;
+        }
+        if (h.version != 1 && h.version != MODEL_VERSION && h.version != MODEL_LAYERS_VERSION) {
+            std::cout << "unknown model version " << h.version << ": " << path << std::endl;
+            return -1;
+        }
+        if (h.version == 1 && h.dtype != MODEL_F32) {
+            return -1;
+        }
+        size_t size = model_dtype_size(h.dtype);
+        std::vector<uint64_t> offsets;
+        if (h.version == MODEL_LAYERS_VERSION) {
+            offsets = matrixOffsets(h.ih, size);
+        } else {
+            offsets.push_back(h.ih);
+            offsets.push_back(h.ho);
+        }
+        std::vector<matrix> loaded(weights);
+        uint64_t sum = 14695981039346656037ULL;
+        for (size_t l = 0; l < loaded.size(); ++l) {
+            matrix &w = loaded[l];
+            std::vector<char> b(size * w.size());
+            if (!is.seekg(offsets[l]) || !is.read(b.data(), b.size())) {
+                return -1;
+            }
+            sum = model_checksum(b.data(), b.size(), sum);
+            std::vector<float> v(w.size());
+            model_weights(b.data(), v.data(), v.size(), h.dtype);
+            // version 1 has both matrices column major, version 2 the second
+            bool colmajor = h.version == 1 || (h.version == 2 && l == 1);
+            if (colmajor) {
+                w = Map<const Matrix<float, Dynamic, Dynamic>>(v.data(), w.rows(), w.cols());
+            } else {
+                w = Map<const matrix>(v.data(), w.rows(), w.cols());
+            }
+        }
+        if (sum != h.checksum) {
+            std::cout << "checksum mismatch: " << path << std::endl;
+            return -1;
+        }
+        weights.swap(loaded);
+        refresh();
+        return 0;
+    }
+
+    // size the buffers of ws for this network, only the first step of a
+    // workspace allocates
+    void reserve(workspace &ws) const {
+        if (ws.grads.size() == weights.size()) {
+            return;
+        }
+        ws.outputs.clear();
+        ws.errors.clear();
+        ws.grads.clear();
+        for (size_t l = 0; l < weights.size(); ++l) {
+            ws.outputs.push_back(matrix(CHUNK, sizes[l + 1]));
+            ws.errors.push_back(matrix(CHUNK, sizes[l + 1]));
+            ws.grads.push_back(matrix(sizes[l], sizes[l + 1]));
+        }
+        ws.dense.resize(CHUNK, sizes[0]);
+        ws.panel.resize(HALF_PANEL * widest());
+    }
+    
+    // the most columns of any weight matrix
+    int widest() const {
+        int n = 0;
+        for (size_t l = 1; l < sizes.size(); ++l) {
+            n = sizes[l] > n ? sizes[l] : n;
+        }
+        return n;
+    }
+
+    void activate(float *x, size_t n) const {
+        if (act == ACT_SIMD) {
+            sigmoid_simd(x, n);
+        } else if (act == ACT_FAST) {
+            sigmoid_fast(x, n);
+        } else {
+            Map<ArrayXf> a(x, n);
+            a = (1.0f + (-a).exp()).inverse();
+        }
+        if (prec != PREC_FP32) {
+            round_half(x, n, prec);
+        }
+    }
+
+    // y = x * weights[l], in a half precision from the 16 bit weights
+    // widened a panel at a time into panel
+    template<typename D, typename O>
+    void product(const MatrixBase<D> &x, size_t l, const MatrixBase<O> &y, float *panel) const {
+        if (prec == PREC_FP32) {
+            const_cast<MatrixBase<O> &>(y).noalias() = x * weights[l];
+        } else {
+            half_product<Dynamic>(x, packed[l].data(), sizes[l + 1], prec, panel, y);
+        }
+    }
+
+    // y = x * weights[l]^T the same way
+    template<typename D, typename O>
+    void productTransposed(const MatrixBase<D> &x, size_t l, const MatrixBase<O> &y, float *panel) const {
+        if (prec == PREC_FP32) {
+            const_cast<MatrixBase<O> &>(y).noalias() = x * weights[l].transpose();
+        } else {
+            half_product_transposed<Dynamic>(x, packed[l].data(), sizes[l], prec, panel, y);
+        }
+    }
+
+    // convert the master weights into the 16 bit copies, once per update
+    void refresh() {
+        if (prec == PREC_FP32) {
+            packed.clear();
+            return;
+        }
+        packed.resize(weights.size());
+        for (size_t l = 0; l < weights.size(); ++l) {
+            packed[l].resize(weights[l].size());
+            to_half(weights[l].data(), packed[l].data(), weights[l].size(), prec);
+        }
+    }
+
+    void derive(float *errors, const float *outputs, size_t n) const {
+        if (act == ACT_EIGEN) {
+            Map<ArrayXf> e(errors, n);
+            Map<const ArrayXf> y(outputs, n);
+            e *= y * (1.0f - y);
+        } else {
+            sigmoid_grad_mul(errors, outputs, n);
+        }
+    }
+
+    // the gradient of one chunk of at most CHUNK rows, added to ws.grads
+    // unless first
+    template<typename D1, typename D2>
+    void chunk(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets, bool first, workspace &ws) const {
+        int n = inputs.rows();
+        int layers = weights.size();
+        PROFILE_TIMER(pt);
+        for (int l = 0; l < layers; ++l) {
+            PROFILE_NEXT(pt, PROF_FORWARD, l == 0 ? n : 0);
+            if (l == 0) {
+                product(inputs, 0, ws.outputs[0].topRows(n), ws.panel.data());
+            } else {
+                product(ws.outputs[l - 1].topRows(n), l, ws.outputs[l].topRows(n), ws.panel.data());
+            }
+            PROFILE_NEXT(pt, PROF_SIGMOID, l == 0 ? n : 0);
+            activate(ws.outputs[l].data(), size_t(n) * sizes[l + 1]);
+        }
+        PROFILE_NEXT(pt, PROF_BACKWARD, n);
+        ws.errors[layers - 1].topRows(n) = targets - ws.outputs[layers - 1].topRows(n);
+        for (int l = layers - 1; l >= 0; --l) {
+            if (l > 0) {
+                productTransposed(ws.errors[l].topRows(n), l, ws.errors[l - 1].topRows(n), ws.panel.data());
+            }
+            derive(ws.errors[l].data(), ws.outputs[l].data(), size_t(n) * sizes[l + 1]);
+            if (first && l == 0) {
+                ws.grads[0].noalias() = inputs.transpose() * ws.errors[0].topRows(n);
+            } else if (l == 0) {
+                ws.grads[0].noalias() += inputs.transpose() * ws.errors[0].topRows(n);
+            } else if (first) {
+                ws.grads[l].noalias() = ws.outputs[l - 1].topRows(n).transpose() * ws.errors[l].topRows(n);
+            } else {
+                ws.grads[l].noalias() += ws.outputs[l - 1].topRows(n).transpose() * ws.errors[l].topRows(n);
+            }
+        }
+    }
+
+    std::vector<int> sizes;
+    std::vector<matrix> weights;
+    std::vector<std::vector<uint16_t>> packed;
+    float lrate;
+    int act;
+    int prec;
+    workspace own;
+};
+
+// builds the network of topology layers learning at rate and returns
+// f(network): a trainer for the topologies compiled with fixed sizes, a
+// layer_network otherwise. f has a call operator template for both
+template<typename F>
+int with_network(const std::vector<int> &layers, float rate, F f)
+{
+    switch (fixed_hidden(layers)) {
+#define MNIST_RUN_FIXED(H) case H: { trainer<784, H, 10> tr(rate); return f(tr); }
+    MNIST_FIXED_HIDDEN(MNIST_RUN_FIXED)
+#undef MNIST_RUN_FIXED
+    default: {
+        layer_network tr(layers, rate);
+        return f(tr);
+    }
+    }
+}
+
+#endif
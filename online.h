@@ -0,0 +1,266 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_ONLINE_H
+#define MNIST_ONLINE_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <random>
+#include "dataset.h"
+#include "pipeline.h"
+#include "stream.h"
+
+// trains a network on the records appended to a file, on a thread of its
+// own. a batch is trained once batch new records are read, or as soon as
+// no more are there to read. with a replay buffer, each batch also takes
+// as many records drawn from the last replay records trained. readers get
+// the weights from model(), a copy published at most every PUBLISH
+// seconds and whenever the file has nothing new, swapped in atomically so
+// neither side ever waits for the other. the network must not be used by
+// anything else while this runs. T is a trainer or a layer_network
+template<typename T>
+class online_learner
+{
+public:
+    enum { IDLE_MS = 10 };
+    static constexpr double PUBLISH = 0.05;
+
+    online_learner(T &tr, int batch, size_t replay) : tr(tr), size(batch > 0 ? batch : 1), capacity(replay), oldest(0), rng(0), stopping(false), failed(false), read(0), trained(0), published(0), malformed(0), pending(0), delivered(0), stamps(0), first(0), latency(0), worst(0), busy(0) {
+        pixels.resize(size_t(size) * 2 * dataset::PIXELS);
+        labels.resize(size * 2);
+        times.resize(size);
+    }
+
+    online_learner(const online_learner &) = delete;
+    online_learner &operator=(const online_learner &) = delete;
+
+    ~online_learner() {
+        stop();
+    }
+
+    int start(const char *path) {
+        if (in.open(path) < 0) {
+            return -1;
+        }
+        source = path;
+        bt = std::chrono::steady_clock::now();
+        publish();
+        worker = std::thread(&online_learner::run, this);
+        return 0;
+    }
+
+    void stop() {
+        stopping = true;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // the weights last published, kept alive for as long as it is held
+    std::shared_ptr<const T> model() const {
+        return std::atomic_load(&current);
+    }
+
+    const std::string &path() const {
+        return source;
+    }
+
+    bool readFailed() const {
+        return failed;
+    }
+
+    void print(std::ostream &os) {
+        std::lock_guard<std::mutex> lk(mtx);
+        double secs = seconds();
+        os << "online: " << source << ", " << read << " records read, " << trained << " trained, "
+           << published << " models published, " << malformed << " malformed, " << replay_labels.size()
+           << " in replay" << std::endl;
+        os << "throughput: " << (busy > 0 ? trained / busy : 0) << " records/s training, " << (secs > 0 ? trained / secs : 0)
+           << " records/s over " << secs << "sec(s), read to published latency: mean "
+           << (delivered > 0 ? latency / delivered * 1000 : 0) << "ms, max " << worst * 1000 << "ms" << std::endl;
+    }
+
+protected:
+    double seconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+    }
+
+    void run() {
+        int n = 0;
+        double last = 0;
+        while (!stopping) {
+            int m = in.poll(pixels.data() + size_t(n) * dataset::PIXELS, labels.data() + n, size - n);
+            if (m < 0) {
+                failed = true;
+                break;
+            }
+            double now = seconds();
+            for (int i = n; i < n + m; ++i) {
+                times[i] = now;
+            }
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                read += m;
+                malformed = in.malformedRows();
+            }
+            n += m;
+            bool drained = n < size;
+            if (n == size || (drained && n > 0)) {
+                train(n);
+                n = 0;
+            }
+            if (pending > 0 && (drained || seconds() - last >= PUBLISH)) {
+                publish();
+                last = seconds();
+            }
+            if (drained) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_MS));
+            }
+        }
+        if (pending > 0) {
+            publish();
+        }
+    }
+
+    // train the n records read with as many from the replay buffer, then
+    // keep them in it over the oldest ones
+    void train(int n) {
+        auto tt = std::chrono::steady_clock::now();
+        int r = 0;
+        size_t kept = replay.size() / dataset::PIXELS;
+        if (kept > 0) {
+            std::uniform_int_distribution<size_t> pick(0, kept - 1);
+            for (; r < n; ++r) {
+                size_t k = pick(rng);
+                memcpy(pixels.data() + size_t(n + r) * dataset::PIXELS, replay.data() + k * dataset::PIXELS, dataset::PIXELS);
+                labels[n + r] = replay_labels[k];
+            }
+        }
+        if (b.inputs.rows() != n + r) {
+            b.inputs.resize(n + r, 784);
+            b.targets.resize(n + r, 10);
+        }
+        b.targets.setZero();
+        for (int i = 0; i < n + r; ++i) {
+            convert_pixels(pixels.data() + size_t(i) * dataset::PIXELS, b.inputs.row(i).data(), 784);
+            if (labels[i] >= 0 && labels[i] < 10) {
+                b.targets(i, labels[i]) = 1;
+            }
+        }
+        tr.train(b.inputs, b.targets);
+        std::lock_guard<std::mutex> lk(mtx);
+        for (int i = 0; i < n && capacity > 0; ++i) {
+            if (kept < capacity) {
+                replay.insert(replay.end(), pixels.data() + size_t(i) * dataset::PIXELS, pixels.data() + size_t(i + 1) * dataset::PIXELS);
+                replay_labels.push_back(labels[i]);
+                ++kept;
+            } else {
+                memcpy(replay.data() + oldest * dataset::PIXELS, pixels.data() + size_t(i) * dataset::PIXELS, dataset::PIXELS);
+                replay_labels[oldest] = labels[i];
+                oldest = (oldest + 1) % capacity;
+            }
+        }
+        if (pending == 0) {
+            first = times[0];
+        }
+        for (int i = 0; i < n; ++i) {
+            stamps += times[i];
+        }
+        pending += n;
+        trained += n;
+        busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - tt).count();
+    }
+
+    // copy the weights into a replica no reader holds any more, or a new
+    // one, and swap it in
+    void publish() {
+        std::shared_ptr<T> p;
+        for (auto &s : spares) {
+            if (s != current && s.use_count() == 1) {
+                p = s;
+                break;
+            }
+        }
+        if (!p) {
+            p.reset(tr.clone());
+            spares.push_back(p);
+        } else {
+            if (weights.empty()) {
+                weights.resize(tr.parameters());
+            }
+            tr.snapshot(weights.data());
+            p->restore(weights.data());
+        }
+        std::atomic_store(&current, std::shared_ptr<const T>(p));
+        double now = seconds();
+        std::lock_guard<std::mutex> lk(mtx);
+        ++published;
+        if (pending > 0) {
+            latency += pending * now - stamps;
+            delivered += pending;
+            worst = now - first > worst ? now - first : worst;
+        }
+        pending = 0;
+        stamps = 0;
+    }
+
+    T &tr;
+    int size;
+    size_t capacity;
+    tail_stream in;
+    std::string source;
+    std::vector<unsigned char> pixels;
+    std::vector<int> labels;
+    std::vector<double> times;
+    std::vector<unsigned char> replay;
+    std::vector<int> replay_labels;
+    size_t oldest;
+    std::mt19937 rng;
+    batch b;
+    std::vector<float> weights;
+    std::vector<std::shared_ptr<T>> spares;
+    std::shared_ptr<const T> current;
+    std::thread worker;
+    std::atomic<bool> stopping;
+    std::atomic<bool> failed;
+    std::chrono::steady_clock::time_point bt;
+    std::mutex mtx;
+    size_t read;
+    size_t trained;
+    size_t published;
+    size_t malformed;
+    size_t pending;
+    size_t delivered;
+    double stamps;
+    double first;
+    double latency;
+    double worst;
+    double busy;
+};
+
+#endif
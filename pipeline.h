@@ -0,0 +1,275 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_PIPELINE_H
+#define MNIST_PIPELINE_H
+
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <immintrin.h>
+#include <Eigen/Dense>
+#include "dataset.h"
+#include "sparse.h"
+#include "profile.h"
+
+// out[i] = normalize_pixel(px[i]), 16, 8 or 4 pixels at a time. the
+// vector paths multiply then add like the scalar one, so the results are
+// equal
+inline void convert_pixels(const unsigned char *px, float *out, int n)
+{
+    int i = 0;
+#ifdef __AVX512F__
+    const __m512 scale16 = _mm512_set1_ps(PIXEL_SCALE);
+    const __m512 bias16 = _mm512_set1_ps(PIXEL_BIAS);
+    for (; i + 16 <= n; i += 16) {
+        __m512i w = _mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(px + i)));
+        __m512 f = _mm512_cvtepi32_ps(w);
+        _mm512_storeu_ps(out + i, _mm512_add_ps(_mm512_mul_ps(f, scale16), bias16));
+    }
+#endif
+#ifdef __AVX2__
+    const __m256 scale = _mm256_set1_ps(PIXEL_SCALE);
+    const __m256 bias = _mm256_set1_ps(PIXEL_BIAS);
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(px + i)));
+        __m256 f = _mm256_cvtepi32_ps(w);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(f, scale), bias));
+    }
+#elif defined(__SSE2__)
+    const __m128 scale = _mm_set1_ps(PIXEL_SCALE);
+    const __m128 bias = _mm_set1_ps(PIXEL_BIAS);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        int32_t b;
+        memcpy(&b, px + i, sizeof(b));
+        __m128i w = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(b), zero), zero);
+        __m128 f = _mm_cvtepi32_ps(w);
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(f, scale), bias));
+    }
+#endif
+    for (; i < n; ++i) {
+        out[i] = normalize_pixel(px[i]);
+    }
+}
+
+// one staged training batch, rows are contiguous so a record converts
+// straight into its row. a sparse source fills sparse instead of inputs
+struct batch
+{
+    Eigen::Matrix<float, Eigen::Dynamic, 784, Eigen::RowMajor> inputs;
+    Eigen::Matrix<float, Eigen::Dynamic, 10, Eigen::RowMajor> targets;
+    sparse_rows sparse;
+};
+
+// hands out the batches of an epoch. records are visited through a
+// permutation of indexes, which is reshuffled at every epoch when
+// shuffling is on, the dataset itself is never copied or reordered.
+// fill() is const, so several threads can stage batches at once
+class batch_source
+{
+public:
+    batch_source(const dataset &data, int size, bool shuffle = false, unsigned seed = 0) : data(data), size(size), shuffle(shuffle), sparse(false), seed(seed), start(0) {
+        if (shuffle) {
+            order.resize(data.size());
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = i;
+            }
+        }
+    }
+
+    size_t records() const {
+        return data.size();
+    }
+
+    int batchSize() const {
+        return size;
+    }
+
+    // batches of the epoch after the skipped records
+    size_t batches() const {
+        return (data.size() - start + size - 1) / size;
+    }
+
+    // leave out the first records of the epoch order, to resume an epoch
+    // part way whatever batch size it was started with
+    void skip(size_t records) {
+        start = records < data.size() ? records : data.size();
+    }
+
+    size_t skipped() const {
+        return start;
+    }
+
+    bool shuffled() const {
+        return shuffle;
+    }
+
+    // stage the nonzero pixels of each batch instead of dense rows
+    void setSparse(bool on) {
+        sparse = on;
+    }
+
+    bool isSparse() const {
+        return sparse;
+    }
+
+    // start epoch lp, the order only depends on the seed and lp
+    void epoch(int lp) {
+        if (shuffle) {
+            std::mt19937 rng(seed + lp);
+            std::shuffle(order.begin(), order.end(), rng);
+        }
+    }
+
+    // stage batch q of the current epoch into b, returns its rows
+    int fill(size_t q, batch &b) const {
+        size_t first = start + q * size;
+        int n = first + size < data.size() ? size : data.size() - first;
+        PROFILE_SCOPE(PROF_STAGE, n);
+        if (b.targets.rows() != n) {
+            b.targets.resize(n, 10);
+        }
+        if (!sparse && b.inputs.rows() != n) {
+            b.inputs.resize(n, 784);
+        }
+        b.targets.setZero();
+        b.sparse.clear();
+        for (int i = 0; i < n; ++i) {
+            size_t r = shuffle ? order[first + i] : first + i;
+            if (sparse) {
+                b.sparse.append(data.pixels(r), 784);
+            } else {
+                convert_pixels(data.pixels(r), b.inputs.row(i).data(), 784);
+            }
+            int label = data.label(r);
+            if (label < 10) {
+                b.targets(i, label) = 1;
+            }
+        }
+        return n;
+    }
+
+protected:
+    const dataset &data;
+    int size;
+    bool shuffle;
+    bool sparse;
+    unsigned seed;
+    size_t start;
+    std::vector<uint32_t> order;
+};
+
+// stages the batches of one epoch on a background thread into a ring of
+// depth buffers, while the caller trains on the ones already staged.
+// the source must not be reshuffled while a prefetcher is running
+class prefetcher
+{
+public:
+    prefetcher(const batch_source &source, int depth = 3) : source(source), slots(depth), produced(0), consumed(0), holding(false), waited(0), stalled(0) {
+        producer = std::thread(&prefetcher::produce, this);
+    }
+
+    prefetcher(const prefetcher &) = delete;
+    prefetcher &operator=(const prefetcher &) = delete;
+
+    ~prefetcher() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            consumed = source.batches();
+        }
+        freed.notify_one();
+        producer.join();
+    }
+
+    // the next staged batch, nullptr after the last one. the batch returned
+    // before is handed back to the producer
+    batch *next() {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (holding) {
+            ++consumed;
+            holding = false;
+            freed.notify_one();
+        }
+        if (consumed >= source.batches()) {
+            return nullptr;
+        }
+        if (produced == consumed) {
+            auto bt = std::chrono::steady_clock::now();
+            ready.wait(lk, [this] { return produced > consumed; });
+            waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+        }
+        holding = true;
+        return &slots[consumed % slots.size()];
+    }
+
+    // seconds the caller spent waiting for a batch to be staged
+    double waitSeconds() const {
+        return waited;
+    }
+
+    // seconds the producer spent waiting for a free buffer
+    double stallSeconds() const {
+        return stalled;
+    }
+
+protected:
+    void produce() {
+        size_t batches = source.batches();
+        for (size_t q = 0; q < batches; ++q) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                if (q - consumed >= slots.size() && consumed < batches) {
+                    auto bt = std::chrono::steady_clock::now();
+                    freed.wait(lk, [this, q, batches] { return q - consumed < slots.size() || consumed >= batches; });
+                    stalled += std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+                }
+                if (consumed >= batches) {
+                    return;
+                }
+            }
+            source.fill(q, slots[q % slots.size()]);
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                produced = q + 1;
+            }
+            ready.notify_one();
+        }
+    }
+
+    const batch_source &source;
+    std::vector<batch> slots;
+    std::thread producer;
+    std::mutex mtx;
+    std::condition_variable ready;
+    std::condition_variable freed;
+    size_t produced;
+    size_t consumed;
+    bool holding;
+    double waited;
+    double stalled;
+};
+
+#endif
@@ -0,0 +1,198 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_PROFILE_H
+#define MNIST_PROFILE_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// per phase time, call and sample counters, compiled in with
+// -DMNIST_PROFILE (make profile), otherwise the macros below are empty.
+// times are summed over all threads, so the phases of a multi threaded
+// run can add up to more than its wall time. the children of a phase are
+// listed under it by the stats command
+enum profile_phase
+{
+    PROF_TRAIN,
+    PROF_STAGE,
+    PROF_FORWARD,
+    PROF_SIGMOID,
+    PROF_BACKWARD,
+    PROF_UPDATE,
+    PROF_REDUCE,
+    PROF_SCORE,
+    PROF_CONVERT,
+    PROF_PREDICT,
+    PROF_PREDICT_INT8,
+    PROF_PHASES
+};
+
+inline const char *profile_phase_name(int phase)
+{
+    static const char *names[PROF_PHASES] = {
+        "train", "stage", "forward", "sigmoid", "backward", "update", "reduce",
+        "score", "convert", "predict", "predict_int8"
+    };
+    return names[phase];
+}
+
+inline int profile_phase_parent(int phase)
+{
+    if (phase > PROF_TRAIN && phase < PROF_SCORE) {
+        return PROF_TRAIN;
+    }
+    if (phase > PROF_SCORE) {
+        return PROF_SCORE;
+    }
+    return -1;
+}
+
+struct profile_counter
+{
+    std::atomic<uint64_t> nanos;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> samples;
+};
+
+inline profile_counter *profile_counters()
+{
+    static profile_counter counters[PROF_PHASES];
+    return counters;
+}
+
+inline void profile_add(int phase, uint64_t nanos, uint64_t samples)
+{
+    profile_counter &c = profile_counters()[phase];
+    c.nanos.fetch_add(nanos, std::memory_order_relaxed);
+    c.calls.fetch_add(1, std::memory_order_relaxed);
+    c.samples.fetch_add(samples, std::memory_order_relaxed);
+}
+
+inline void profile_reset()
+{
+    for (int i = 0; i < PROF_PHASES; ++i) {
+        profile_counter &c = profile_counters()[i];
+        c.nanos = 0;
+        c.calls = 0;
+        c.samples = 0;
+    }
+}
+
+inline void profile_print(std::ostream &os)
+{
+    os << std::left << std::setw(16) << "phase" << std::right << std::setw(10) << "calls" << std::setw(12) << "sec(s)"
+       << std::setw(9) << "share" << std::setw(12) << "us/call" << std::setw(14) << "samples/s" << std::endl;
+    for (int i = 0; i < PROF_PHASES; ++i) {
+        const profile_counter &c = profile_counters()[i];
+        uint64_t calls = c.calls;
+        if (calls == 0) {
+            continue;
+        }
+        int parent = profile_phase_parent(i);
+        double secs = c.nanos * 1e-9;
+        double total = parent < 0 ? secs : profile_counters()[parent].nanos * 1e-9;
+        std::string name = std::string(parent < 0 ? "" : "  ") + profile_phase_name(i);
+        os << std::left << std::setw(16) << name << std::right << std::setw(10) << calls << std::setw(12) << secs
+           << std::setw(8) << std::fixed << std::setprecision(1) << (total > 0 ? secs * 100 / total : 0) << "%"
+           << std::setw(12) << secs * 1e6 / calls << std::defaultfloat << std::setprecision(6);
+        if (c.samples > 0 && secs > 0) {
+            os << std::setw(14) << c.samples / secs;
+        }
+        os << std::endl;
+    }
+}
+
+#ifdef MNIST_PROFILE
+
+// adds the time from construction to destruction to one phase
+class profile_scope
+{
+public:
+    profile_scope(int phase, uint64_t samples) : phase(phase), samples(samples), bt(std::chrono::steady_clock::now()) {
+    }
+
+    ~profile_scope() {
+        profile_add(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - bt).count(), samples);
+    }
+
+protected:
+    int phase;
+    uint64_t samples;
+    std::chrono::steady_clock::time_point bt;
+};
+
+// times a run of consecutive phases with one clock read per switch
+class profile_timer
+{
+public:
+    profile_timer() : phase(-1), samples(0) {
+    }
+
+    ~profile_timer() {
+        stop();
+    }
+
+    void next(int p, uint64_t n) {
+        auto t = std::chrono::steady_clock::now();
+        if (phase >= 0) {
+            profile_add(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(t - bt).count(), samples);
+        }
+        phase = p;
+        samples = n;
+        bt = t;
+    }
+
+    void stop() {
+        if (phase >= 0) {
+            next(-1, 0);
+        }
+    }
+
+protected:
+    int phase;
+    uint64_t samples;
+    std::chrono::steady_clock::time_point bt;
+};
+
+#define PROFILE_ENABLED 1
+#define PROFILE_NAME2(a, b) a##b
+#define PROFILE_NAME(a, b) PROFILE_NAME2(a, b)
+#define PROFILE_SCOPE(phase, samples) profile_scope PROFILE_NAME(profile_scope_, __LINE__)(phase, samples)
+#define PROFILE_TIMER(t) profile_timer t
+#define PROFILE_NEXT(t, phase, samples) t.next(phase, samples)
+#define PROFILE_STOP(t) t.stop()
+
+#else
+
+#define PROFILE_ENABLED 0
+#define PROFILE_SCOPE(phase, samples)
+#define PROFILE_TIMER(t)
+#define PROFILE_NEXT(t, phase, samples)
+#define PROFILE_STOP(t)
+
+#endif
+
+#endif
@@ -0,0 +1,548 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_QUANTIZE_H
+#define MNIST_QUANTIZE_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+#include <immintrin.h>
+#include <Eigen/Dense>
+#include "trainer.h"
+#include "dataset.h"
+#include "kernels.h"
+
+// integer gemm of the quantized path:
+//   c[r * ldc + j] = sum over t < K of a[r * lda + t] * w(t, j)
+// for r < m and j < n. a holds uint8 activations, w int8 weights packed
+// by pack_u8s8: the columns go in blocks of U8S8_COLS, and a block stores
+// 4 consecutive t of each of its columns, then the next 4 t. the columns
+// of a block are the lanes of the accumulators, so no output needs a
+// horizontal sum. with vnni the bytes are multiplied in place by dpbusd,
+// otherwise a block of rows of a is widened to int16 once and multiplied
+// with madd, which adds the products in 32 bits, so nothing saturates in
+// either path
+#if defined(__AVX512BW__) || defined(__AVXVNNI__)
+enum { U8S8_COLS = 16 };
+#elif defined(__AVX2__)
+enum { U8S8_COLS = 8 };
+#else
+enum { U8S8_COLS = 4 };
+#endif
+
+// the madd kernels read every 4 widened activations as a whole register
+// of them, U8S8_WIDEN copies in a row: a broadcast would cost one more
+// instruction per load, and the loop is bound by how fast they issue.
+// sse2 keeps 3 rows in flight, with 4 gcc spills an accumulator
+#if defined(__AVX512BW__) || defined(__AVXVNNI__)
+enum { U8S8_WIDEN = 1, U8S8_ROWS = 4 };
+#elif defined(__AVX2__)
+enum { U8S8_WIDEN = 4, U8S8_ROWS = 4 };
+#elif defined(__SSE2__)
+enum { U8S8_WIDEN = 2, U8S8_ROWS = 3 };
+#else
+enum { U8S8_WIDEN = 1, U8S8_ROWS = 4 };
+#endif
+
+// the dispatched avx512 build also runs on cpus without vnni, so its vnni
+// kernel is compiled for that target alone and picked at run time
+#if defined(__AVX512BW__) && !defined(__AVX512VNNI__)
+#define U8S8_VNNI_RUNTIME
+#define U8S8_VNNI_TARGET __attribute__((target("avx512vnni")))
+#elif defined(__AVX512BW__)
+#define U8S8_VNNI_TARGET
+#endif
+
+#ifdef U8S8_VNNI_RUNTIME
+inline bool u8s8_vnni()
+{
+    static const bool vnni = __builtin_cpu_supports("avx512vnni");
+    return vnni;
+}
+#endif
+
+inline const char *int8_kernel_name()
+{
+#if defined(U8S8_VNNI_RUNTIME)
+    return u8s8_vnni() ? "avx512vnni" : "avx512";
+#elif defined(__AVX512BW__)
+    return "avx512vnni";
+#elif defined(__AVXVNNI__)
+    return "avxvnni";
+#elif defined(__AVX2__)
+    return "avx2";
+#elif defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// pack the k x n weights w(t, j) = q[j * ld + t] for gemm_u8s8, n rounded
+// up to whole blocks with zero columns. k must be a multiple of 4
+inline void pack_u8s8(const int8_t *q, int ld, int k, int n, std::vector<int8_t> &packed)
+{
+    int blocks = (n + U8S8_COLS - 1) / U8S8_COLS;
+    packed.assign(size_t(blocks) * U8S8_COLS * k, 0);
+    int8_t *p = packed.data();
+    for (int jb = 0; jb < blocks; ++jb) {
+        for (int t = 0; t < k; t += 4) {
+            for (int jj = 0; jj < U8S8_COLS; ++jj, p += 4) {
+                int j = jb * U8S8_COLS + jj;
+                for (int u = 0; u < 4 && j < n; ++u) {
+                    p[u] = q[j * ld + t + u];
+                }
+            }
+        }
+    }
+}
+
+#ifdef U8S8_VNNI_TARGET
+// MR rows of a against the block of columns at b
+template<int K, int MR>
+U8S8_VNNI_TARGET inline void gemm_u8s8_vnni(const uint8_t *a, int lda, const int8_t *b, int32_t *c, int ldc)
+{
+    __m512i acc[MR];
+    for (int r = 0; r < MR; ++r) {
+        acc[r] = _mm512_setzero_si512();
+    }
+    for (int t = 0; t < K; t += 4, b += 4 * U8S8_COLS) {
+        __m512i w = _mm512_loadu_si512(b);
+        for (int r = 0; r < MR; ++r) {
+            int32_t x;
+            memcpy(&x, a + r * lda + t, sizeof(x));
+            acc[r] = _mm512_dpbusd_epi32(acc[r], _mm512_set1_epi32(x), w);
+        }
+    }
+    for (int r = 0; r < MR; ++r) {
+        _mm512_storeu_si512(c + r * ldc, acc[r]);
+    }
+}
+
+// 8 rows at a time: dpbusd takes 5 cycles, fewer accumulators would wait
+template<int K>
+U8S8_VNNI_TARGET EIGEN_DONT_INLINE void gemm_u8s8_vnni(const uint8_t *a, int lda, int m, const int8_t *b, int n, int32_t *c, int ldc)
+{
+    for (int j = 0; j < n; j += U8S8_COLS, b += U8S8_COLS * K) {
+        int r = 0;
+        for (; r + 8 <= m; r += 8) {
+            gemm_u8s8_vnni<K, 8>(a + r * lda, lda, b, c + r * ldc + j, ldc);
+        }
+        for (; r < m; ++r) {
+            gemm_u8s8_vnni<K, 1>(a + r * lda, lda, b, c + r * ldc + j, ldc);
+        }
+    }
+}
+#endif
+
+// MR rows of a, widened to int16 in wa, against the block of columns at b
+template<int K, int MR>
+inline void gemm_u8s8_block(const uint8_t *a, int lda, const int16_t *wa, const int8_t *b, int32_t *c, int ldc)
+{
+#if defined(__AVX512BW__)
+    (void)a; (void)lda;
+    __m512i acc[MR][2];
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = acc[r][1] = _mm512_setzero_si512();
+    }
+    for (int t = 0; t < K; t += 4, b += 4 * U8S8_COLS) {
+        __m512i v = _mm512_loadu_si512(b);
+        __m512i w0 = _mm512_cvtepi8_epi16(_mm512_castsi512_si256(v));
+        __m512i w1 = _mm512_cvtepi8_epi16(_mm512_extracti64x4_epi64(v, 1));
+        for (int r = 0; r < MR; ++r) {
+            int64_t x;
+            memcpy(&x, wa + r * K + t, sizeof(x));
+            __m512i xx = _mm512_set1_epi64(x);
+            acc[r][0] = _mm512_add_epi32(acc[r][0], _mm512_madd_epi16(xx, w0));
+            acc[r][1] = _mm512_add_epi32(acc[r][1], _mm512_madd_epi16(xx, w1));
+        }
+    }
+    // every column has two partial sums side by side: add them in the low
+    // one and keep the low halves of the 64 bit lanes
+    for (int r = 0; r < MR; ++r) {
+        for (int h = 0; h < 2; ++h) {
+            __m512i s = _mm512_add_epi32(acc[r][h], _mm512_shuffle_epi32(acc[r][h], _MM_PERM_CDAB));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(c + r * ldc + h * 8), _mm512_cvtepi64_epi32(s));
+        }
+    }
+#elif defined(__AVXVNNI__)
+    (void)wa;
+    __m256i acc[MR][2];
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+    }
+    for (int t = 0; t < K; t += 4, b += 4 * U8S8_COLS) {
+        __m256i w0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b));
+        __m256i w1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + 32));
+        for (int r = 0; r < MR; ++r) {
+            int32_t x;
+            memcpy(&x, a + r * lda + t, sizeof(x));
+            __m256i xx = _mm256_set1_epi32(x);
+            acc[r][0] = _mm256_dpbusd_avx_epi32(acc[r][0], xx, w0);
+            acc[r][1] = _mm256_dpbusd_avx_epi32(acc[r][1], xx, w1);
+        }
+    }
+    for (int r = 0; r < MR; ++r) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(c + r * ldc), acc[r][0]);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(c + r * ldc + 8), acc[r][1]);
+    }
+#elif defined(__AVX2__)
+    (void)a; (void)lda;
+    __m256i acc[MR][2];
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = acc[r][1] = _mm256_setzero_si256();
+    }
+    for (int t = 0; t < K; t += 4, b += 4 * U8S8_COLS) {
+        __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+        __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + 16)));
+        for (int r = 0; r < MR; ++r) {
+            __m256i xx = _mm256_load_si256(reinterpret_cast<const __m256i *>(wa + (r * K + t) * U8S8_WIDEN));
+            acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(xx, w0));
+            acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_madd_epi16(xx, w1));
+        }
+    }
+    // hadd gives columns 0 1 4 5 2 3 6 7, the permute puts them in order
+    for (int r = 0; r < MR; ++r) {
+        __m256i s = _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[r][0], acc[r][1]), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(c + r * ldc), s);
+    }
+#elif defined(__SSE2__)
+    (void)a; (void)lda;
+    __m128i acc[MR][2];
+    for (int r = 0; r < MR; ++r) {
+        acc[r][0] = acc[r][1] = _mm_setzero_si128();
+    }
+    for (int t = 0; t < K; t += 4, b += 4 * U8S8_COLS) {
+        // sign extend the weights by unpacking them with themselves
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+        __m128i w0 = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+        __m128i w1 = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+        for (int r = 0; r < MR; ++r) {
+            __m128i xx = _mm_load_si128(reinterpret_cast<const __m128i *>(wa + (r * K + t) * U8S8_WIDEN));
+            acc[r][0] = _mm_add_epi32(acc[r][0], _mm_madd_epi16(xx, w0));
+            acc[r][1] = _mm_add_epi32(acc[r][1], _mm_madd_epi16(xx, w1));
+        }
+    }
+    for (int r = 0; r < MR; ++r) {
+        __m128i s0 = _mm_add_epi32(acc[r][0], _mm_shuffle_epi32(acc[r][0], 0xb1));
+        __m128i s1 = _mm_add_epi32(acc[r][1], _mm_shuffle_epi32(acc[r][1], 0xb1));
+        __m128 s = _mm_shuffle_ps(_mm_castsi128_ps(s0), _mm_castsi128_ps(s1), _MM_SHUFFLE(2, 0, 2, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(c + r * ldc), _mm_castps_si128(s));
+    }
+#else
+    (void)wa;
+    for (int r = 0; r < MR; ++r) {
+        for (int jj = 0; jj < U8S8_COLS; ++jj) {
+            int32_t s = 0;
+            for (int t = 0; t < K; ++t) {
+                s += int32_t(a[r * lda + t]) * b[(t / 4 * U8S8_COLS + jj) * 4 + t % 4];
+            }
+            c[r * ldc + jj] = s;
+        }
+    }
+#endif
+}
+
+// MR rows of a widened into wa, every 4 of them U8S8_WIDEN times
+template<int K, int MR>
+inline void widen_u8s8(const uint8_t *a, int lda, int16_t *wa)
+{
+    for (int r = 0; r < MR; ++r) {
+        for (int t = 0; t < K; t += 4) {
+            for (int u = 0; u < 4 * U8S8_WIDEN; ++u) {
+                wa[(r * K + t) * U8S8_WIDEN + u] = a[r * lda + t + u % 4];
+            }
+        }
+    }
+}
+
+// kept out of line: inlined into the scoring loop, gcc spills the
+// accumulators and the kernel runs at half speed. b is packed by
+// pack_u8s8, K must be a multiple of 4 and n of U8S8_COLS
+template<int K>
+EIGEN_DONT_INLINE void gemm_u8s8(const uint8_t *a, int lda, int m, const int8_t *b, int n, int32_t *c, int ldc)
+{
+    static_assert(K % 4 == 0, "K must be a multiple of 4");
+#ifdef U8S8_VNNI_RUNTIME
+    if (u8s8_vnni()) {
+        gemm_u8s8_vnni<K>(a, lda, m, b, n, c, ldc);
+        return;
+    }
+#elif defined(__AVX512BW__)
+    gemm_u8s8_vnni<K>(a, lda, m, b, n, c, ldc);
+    return;
+#endif
+    alignas(64) int16_t wa[U8S8_ROWS * K * U8S8_WIDEN];
+    int r = 0;
+    for (; r + U8S8_ROWS <= m; r += U8S8_ROWS) {
+        widen_u8s8<K, U8S8_ROWS>(a + r * lda, lda, wa);
+        for (int j = 0; j < n; j += U8S8_COLS) {
+            gemm_u8s8_block<K, U8S8_ROWS>(a + r * lda, lda, wa, b + j * K, c + r * ldc + j, ldc);
+        }
+    }
+    for (; r < m; ++r) {
+        widen_u8s8<K, 1>(a + r * lda, lda, wa);
+        for (int j = 0; j < n; j += U8S8_COLS) {
+            gemm_u8s8_block<K, 1>(a + r * lda, lda, wa, b + j * K, c + r * ldc + j, ldc);
+        }
+    }
+}
+
+// q[i] = x[i] * inv rounded and saturated to uint8, for x[i] >= 0
+inline void quantize_u8(const float *x, float inv, uint8_t *q, int n)
+{
+    int i = 0;
+#if defined(__AVX512F__)
+    const __m512 vi = _mm512_set1_ps(inv), half = _mm512_set1_ps(0.5f);
+    for (; i + 16 <= n; i += 16) {
+        __m512i v = _mm512_cvttps_epi32(_mm512_fmadd_ps(_mm512_loadu_ps(x + i), vi, half));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(q + i), _mm512_cvtusepi32_epi8(v));
+    }
+#elif defined(__AVX2__)
+    const __m256 vi = _mm256_set1_ps(inv), half = _mm256_set1_ps(0.5f);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_cvttps_epi32(MM256_FMADD(_mm256_loadu_ps(x + i), vi, half));
+        __m128i w = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(q + i), _mm_packus_epi16(w, w));
+    }
+#elif defined(__SSE2__)
+    const __m128 vi = _mm_set1_ps(inv), half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(x + i), vi), half));
+        v = _mm_packs_epi32(v, v);
+        int32_t b = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+        memcpy(q + i, &b, sizeof(b));
+    }
+#endif
+    for (; i < n; ++i) {
+        float v = x[i] * inv + 0.5f;
+        q[i] = v < 255 ? uint8_t(v) : 255;
+    }
+}
+
+// int8 copy of a trainer for scoring. every column of both weight matrices
+// has its own scale, the hidden activations are quantized to uint8 with a
+// scale taken from a sample of the data, and pixels are used as the raw
+// uint8 values: with x = PIXEL_SCALE * p + PIXEL_BIAS the first layer is
+//   x * w = PIXEL_SCALE * (p * w) + PIXEL_BIAS * colsum(w)
+// where only p * w is computed in integers
+template<int INPUT, int HIDDEN, int OUTPUT>
+class quantized_model
+{
+public:
+    // padded sizes: hidden units are both the n of the first gemm and the
+    // k of the second, outputs its n
+    enum {
+        KH = (HIDDEN + U8S8_COLS - 1) / U8S8_COLS * U8S8_COLS,
+        NO = (OUTPUT + U8S8_COLS - 1) / U8S8_COLS * U8S8_COLS,
+        BLOCK = 32
+    };
+
+    static_assert(INPUT % 16 == 0, "INPUT must be a multiple of 16");
+
+    quantized_model() : hscale(1) {
+    }
+
+    static bool available() {
+        return true;
+    }
+
+    // quantize the weights of tr, calibrating on up to sample records
+    // spread evenly over data
+    void quantize(const trainer<INPUT, HIDDEN, OUTPUT> &tr, const dataset &data, size_t sample = 1024) {
+        size_t n = data.size() < sample ? data.size() : sample;
+        Matrix<float, Dynamic, Dynamic> px(n > 0 ? n : 1, INPUT);
+        px.setZero();
+        for (size_t i = 0; i < n; ++i) {
+            const unsigned char *p = data.pixels(i * data.size() / n);
+            for (int t = 0; t < INPUT; ++t) {
+                px(i, t) = p[t];
+            }
+        }
+        const Matrix<float, INPUT, HIDDEN, RowMajor> &wih = tr.getIh();
+        const Matrix<float, HIDDEN, OUTPUT> &who = tr.getHo();
+        std::vector<int8_t> q(HIDDEN * INPUT);
+        sih.assign(KH, 0);
+        bih.assign(KH, 0);
+        quantizeColumns(px, wih, q.data(), INPUT, sih.data());
+        pack_u8s8(q.data(), INPUT, INPUT, HIDDEN, qih);
+        for (int j = 0; j < HIDDEN; ++j) {
+            sih[j] *= PIXEL_SCALE;
+            bih[j] = PIXEL_BIAS * wih.col(j).sum();
+        }
+        // hidden activations of the sample through the quantized layer
+        Matrix<float, Dynamic, Dynamic> h(px.rows(), HIDDEN);
+        std::vector<int32_t> c(BLOCK * KH);
+        std::vector<unsigned char> rows(BLOCK * INPUT);
+        for (int r = 0; r < px.rows(); r += BLOCK) {
+            int m = px.rows() - r < BLOCK ? px.rows() - r : int(BLOCK);
+            for (int i = 0; i < m; ++i) {
+                for (int t = 0; t < INPUT; ++t) {
+                    rows[i * INPUT + t] = (unsigned char)px(r + i, t);
+                }
+            }
+            gemm_u8s8<INPUT>(rows.data(), INPUT, m, qih.data(), KH, c.data(), KH);
+            for (int i = 0; i < m; ++i) {
+                for (int j = 0; j < HIDDEN; ++j) {
+                    h(r + i, j) = c[i * KH + j] * sih[j] + bih[j];
+                }
+            }
+        }
+        h.array() = (1.0f + (-h.array()).exp()).inverse();
+        float hmax = h.maxCoeff();
+        hscale = hmax > 0 ? hmax / 255 : 1;
+        h = (h / hscale).array().round() * hscale;
+        q.assign(OUTPUT * KH, 0);
+        sho.assign(OUTPUT, 0);
+        quantizeColumns(h, who, q.data(), KH, sho.data());
+        pack_u8s8(q.data(), KH, KH, OUTPUT, qho);
+        for (int k = 0; k < OUTPUT; ++k) {
+            sho[k] *= hscale;
+        }
+    }
+
+    // score n records of uint8 pixels stored one after the other, in
+    // blocks of BLOCK records which go through both layers in turn. the
+    // padded hidden units are requantized along with the rest, their
+    // weights in the second layer are zero
+    void predict(const unsigned char *pixels, int n, Matrix<float, Dynamic, OUTPUT> &outputs) const {
+        PROFILE_SCOPE(PROF_PREDICT_INT8, n);
+        outputs.resize(n, OUTPUT);
+        alignas(64) int32_t c1[BLOCK * KH];
+        alignas(64) float hf[BLOCK * KH];
+        alignas(64) uint8_t hq[BLOCK * KH];
+        alignas(64) int32_t c2[BLOCK * NO];
+        const float *s = sih.data(), *b = bih.data();
+        for (int r = 0; r < n; r += BLOCK) {
+            int m = n - r < BLOCK ? n - r : BLOCK;
+            gemm_u8s8<INPUT>(pixels + size_t(r) * INPUT, INPUT, m, qih.data(), KH, c1, KH);
+            for (int i = 0; i < m; ++i) {
+                for (int j = 0; j < KH; ++j) {
+                    hf[i * KH + j] = c1[i * KH + j] * s[j] + b[j];
+                }
+            }
+            sigmoid_simd(hf, m * KH);
+            quantize_u8(hf, 1 / hscale, hq, m * KH);
+            gemm_u8s8<KH>(hq, KH, m, qho.data(), NO, c2, NO);
+            for (int i = 0; i < m; ++i) {
+                for (int k = 0; k < OUTPUT; ++k) {
+                    outputs(r + i, k) = c2[i * NO + k] * sho[k];
+                }
+            }
+        }
+        sigmoid_simd(outputs.data(), outputs.size());
+    }
+
+    // bytes of the weights and their scales, without padding
+    static size_t bytes() {
+        return INPUT * HIDDEN + HIDDEN * OUTPUT + sizeof(float) * (2 * HIDDEN + OUTPUT + 1);
+    }
+
+protected:
+    // int8 columns of w into q, one column per row of ld bytes. the range
+    // of every column is clipped at the fraction of its largest weight
+    // which gives the smallest squared error of x * w over the sample
+    template<typename DX, typename DW>
+    static void quantizeColumns(const MatrixBase<DX> &x, const MatrixBase<DW> &w, int8_t *q, int ld, float *scale) {
+        static const float fractions[] = { 1.0f, 0.9f, 0.8f, 0.7f, 0.6f, 0.5f };
+        int rows = w.rows(), cols = w.cols();
+        Matrix<float, Dynamic, Dynamic> wq(rows, cols), e;
+        std::vector<float> amax(cols), best(cols, -1);
+        for (int j = 0; j < cols; ++j) {
+            amax[j] = w.col(j).cwiseAbs().maxCoeff();
+        }
+        for (float f : fractions) {
+            for (int j = 0; j < cols; ++j) {
+                float s = amax[j] > 0 ? amax[j] * f / 127 : 1;
+                for (int t = 0; t < rows; ++t) {
+                    wq(t, j) = quantizeWeight(w(t, j), s) * s;
+                }
+            }
+            e.noalias() = x * (wq - w);
+            for (int j = 0; j < cols; ++j) {
+                float err = e.col(j).squaredNorm();
+                if (best[j] >= 0 && err >= best[j]) {
+                    continue;
+                }
+                best[j] = err;
+                scale[j] = amax[j] > 0 ? amax[j] * f / 127 : 1;
+                for (int t = 0; t < rows; ++t) {
+                    q[j * ld + t] = quantizeWeight(w(t, j), scale[j]);
+                }
+            }
+        }
+    }
+
+    static int8_t quantizeWeight(float w, float s) {
+        float v = std::round(w / s);
+        return int8_t(v > 127 ? 127 : (v < -127 ? -127 : v));
+    }
+
+    std::vector<int8_t> qih;
+    std::vector<int8_t> qho;
+    std::vector<float> sih;
+    std::vector<float> bih;
+    std::vector<float> sho;
+    float hscale;
+};
+
+// stands in for the int8 copy of a network that has none, a layer_network
+// with other than one hidden layer
+class no_quantized_model
+{
+public:
+    static bool available() {
+        return false;
+    }
+
+    template<typename T>
+    void quantize(const T &, const dataset &, size_t = 1024) {
+    }
+
+    template<typename O>
+    void predict(const unsigned char *, int, O &) const {
+    }
+
+    template<typename D, typename O>
+    void predict(const MatrixBase<D> &, O &) const {
+    }
+
+    static size_t bytes() {
+        return 0;
+    }
+};
+
+// the int8 copy of network T
+template<typename T>
+struct quantized_of
+{
+    typedef no_quantized_model type;
+};
+
+template<int INPUT, int HIDDEN, int OUTPUT>
+struct quantized_of<trainer<INPUT, HIDDEN, OUTPUT>>
+{
+    typedef quantized_model<INPUT, HIDDEN, OUTPUT> type;
+};
+
+#endif
@@ -0,0 +1,455 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_SERVER_H
+#define MNIST_SERVER_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "trainer.h"
+#include "dataset.h"
+#include "pipeline.h"
+
+// the prediction protocol over a unix stream socket, one answer per request
+// in request order:
+//   raw request:  'R' followed by 784 pixel bytes
+//   csv request:  a dataset row "label,p0,...,p783" or just "p0,...,p783",
+//                 ended by '\n', a longer line than MAX_LINE bytes closes
+//                 the connection
+//   answer:       "<label> <p0> ... <p9>\n", or "error\n" for a bad row
+#define SERVE_RAW 'R'
+
+// latencies in microseconds, counted in buckets 1% wide, so percentiles are
+// within 1% and the memory used does not grow with the requests
+class latency_histogram
+{
+public:
+    enum { BUCKETS = 2048 };
+
+    latency_histogram() : counts(BUCKETS, 0), total(0), longest(0) {
+    }
+
+    void add(double us) {
+        int b = us > 1 ? int(std::log(us) / std::log(step())) : 0;
+        ++counts[b < BUCKETS ? b : BUCKETS - 1];
+        ++total;
+        if (us > longest) {
+            longest = us;
+        }
+    }
+
+    void merge(const latency_histogram &o) {
+        for (int i = 0; i < BUCKETS; ++i) {
+            counts[i] += o.counts[i];
+        }
+        total += o.total;
+        if (o.longest > longest) {
+            longest = o.longest;
+        }
+    }
+
+    size_t count() const {
+        return total;
+    }
+
+    double max() const {
+        return longest;
+    }
+
+    // the upper bound of the bucket holding percentile p, in [0, 100]
+    double percentile(double p) const {
+        size_t rank = size_t(std::ceil(total * p / 100));
+        size_t seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) {
+                double us = std::pow(step(), i + 1);
+                return us < longest ? us : longest;
+            }
+        }
+        return longest;
+    }
+
+protected:
+    static double step() {
+        return 1.01;
+    }
+
+    std::vector<size_t> counts;
+    size_t total;
+    double longest;
+};
+
+// answers prediction requests from other processes on a unix socket. every
+// connection has a thread that reads its requests and waits for the answers,
+// a batcher thread coalesces the requests queued by all connections into one
+// predict call: a batch is scored once it has max_batch requests, or every
+// open connection has a request in it, or its oldest request has waited
+// max_wait microseconds
+template<typename T>
+class prediction_server
+{
+public:
+    enum { INPUT = dataset::PIXELS, OUTPUT = 10, REPORT_SECONDS = 10, MAX_LINE = 8192 };
+
+    prediction_server(const T &tr, int max_batch = 32, int max_wait = 200) : tr(tr), maxBatch(max_batch > 0 ? max_batch : 1), maxWait(max_wait > 0 ? max_wait : 0), listener(-1), stopping(false), opened(0), closing(false), batches(0), batched(0), served(0) {
+    }
+
+    prediction_server(const prediction_server &) = delete;
+    prediction_server &operator=(const prediction_server &) = delete;
+
+    ~prediction_server() {
+        if (listener >= 0) {
+            close(listener);
+            unlink(path.c_str());
+        }
+    }
+
+    // bind and listen on path, a stale socket file is replaced
+    int open(const char *socket_path) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            std::cout << "socket path too long: " << socket_path << std::endl;
+            return -1;
+        }
+        strcpy(addr.sun_path, socket_path);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener < 0) {
+            std::cout << "cannot create socket" << std::endl;
+            return -1;
+        }
+        unlink(socket_path);
+        if (bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(listener, 128) < 0) {
+            std::cout << "cannot listen on: " << socket_path << std::endl;
+            close(listener);
+            listener = -1;
+            return -1;
+        }
+        path = socket_path;
+        return 0;
+    }
+
+    // serve until stop() is called or *signalled is set, reporting every
+    // REPORT_SECONDS while requests come in and once more at the end.
+    // signalled is the flag of a signal handler, it is polled
+    void run(const volatile sig_atomic_t *signalled = nullptr) {
+        std::thread batcher(&prediction_server::batchLoop, this);
+        auto reported = std::chrono::steady_clock::now();
+        size_t last = 0;
+        while (!stopping.load() && !(signalled && *signalled)) {
+            pollfd pfd = { listener, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) > 0) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd >= 0) {
+                    connection *c = new connection(fd);
+                    c->worker = std::thread(&prediction_server::serve, this, c);
+                    conns.push_back(c);
+                }
+            }
+            reap(false);
+            auto now = std::chrono::steady_clock::now();
+            if (now - reported >= std::chrono::seconds(REPORT_SECONDS)) {
+                reported = now;
+                if (served.load() != last) {
+                    last = served.load();
+                    report(std::cout);
+                }
+            }
+        }
+        close(listener);
+        listener = -1;
+        unlink(path.c_str());
+        reap(true);
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            closing = true;
+        }
+        queued.notify_one();
+        batcher.join();
+        report(std::cout);
+    }
+
+    // stop serving from another thread
+    void stop() {
+        stopping.store(true);
+    }
+
+    void report(std::ostream &os) {
+        std::lock_guard<std::mutex> lk(stats);
+        size_t n = latency.count();
+        std::chrono::duration<double> secs = last - first;
+        os << "served: " << n << " requests";
+        if (n > 0) {
+            if (secs.count() > 0) {
+                os << ", " << n / secs.count() << " requests/s";
+            }
+            os << ", latency p50 " << latency.percentile(50) << "us, p99 " << latency.percentile(99)
+               << "us, max " << latency.max() << "us, " << batches << " batches of " << double(batched) / batches;
+        }
+        os << std::endl;
+    }
+
+protected:
+    struct request
+    {
+        unsigned char pixels[INPUT];
+        float outputs[OUTPUT];
+        bool done;
+        std::chrono::steady_clock::time_point arrived;
+        std::condition_variable answered;
+    };
+
+    struct connection
+    {
+        explicit connection(int fd) : fd(fd), finished(false), begin(0), end(0) {
+        }
+
+        int fd;
+        std::thread worker;
+        std::atomic<bool> finished;
+        char buffer[4096];
+        int begin;
+        int end;
+    };
+
+    // the next byte of c, -1 when the peer is gone
+    static int readByte(connection *c) {
+        if (c->begin == c->end) {
+            ssize_t n;
+            do {
+                n = recv(c->fd, c->buffer, sizeof(c->buffer), 0);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                return -1;
+            }
+            c->begin = 0;
+            c->end = n;
+        }
+        return static_cast<unsigned char>(c->buffer[c->begin++]);
+    }
+
+    static bool writeAll(int fd, const char *p, size_t n) {
+        while (n > 0) {
+            ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return false;
+            }
+            p += w;
+            n -= w;
+        }
+        return true;
+    }
+
+    // read the next request of c into r, returns 1 for a request, 0 for a
+    // malformed csv row and -1 when the connection is done or sent a line
+    // longer than MAX_LINE
+    static int readRequest(connection *c, request &r, std::string &line) {
+        int ch = readByte(c);
+        if (ch < 0) {
+            return -1;
+        }
+        if (ch == SERVE_RAW) {
+            for (int i = 0; i < INPUT; ++i) {
+                int p = readByte(c);
+                if (p < 0) {
+                    return -1;
+                }
+                r.pixels[i] = p;
+            }
+            return 1;
+        }
+        line.clear();
+        while (ch != '\n') {
+            if (ch != '\r') {
+                if (line.size() >= MAX_LINE) {
+                    return -1;
+                }
+                line.push_back(ch);
+            }
+            ch = readByte(c);
+            if (ch < 0) {
+                return -1;
+            }
+        }
+        return parse_row(line.data(), line.size(), r.pixels) < 0 ? 0 : 1;
+    }
+
+    void serve(connection *c) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            ++opened;
+        }
+        request r;
+        std::string line;
+        char out[32 * (OUTPUT + 1)];
+        int got;
+        while ((got = readRequest(c, r, line)) >= 0) {
+            if (got == 0) {
+                if (!writeAll(c->fd, "error\n", 6)) {
+                    break;
+                }
+                continue;
+            }
+            r.done = false;
+            r.arrived = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                pending.push_back(&r);
+                if (pending.size() == 1 || full()) {
+                    queued.notify_one();
+                }
+                r.answered.wait(lk, [&r] { return r.done; });
+            }
+            int label = 0;
+            for (int i = 1; i < OUTPUT; ++i) {
+                if (r.outputs[i] > r.outputs[label]) {
+                    label = i;
+                }
+            }
+            int n = snprintf(out, sizeof(out), "%d", label);
+            for (int i = 0; i < OUTPUT; ++i) {
+                n += snprintf(out + n, sizeof(out) - n, " %g", r.outputs[i]);
+            }
+            out[n++] = '\n';
+            if (!writeAll(c->fd, out, n)) {
+                break;
+            }
+            auto now = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lk(stats);
+            if (latency.count() == 0) {
+                first = r.arrived;
+            }
+            last = now;
+            latency.add(std::chrono::duration<double, std::micro>(now - r.arrived).count());
+            ++served;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            --opened;
+        }
+        queued.notify_one();
+        close(c->fd);
+        c->finished.store(true);
+    }
+
+    // join the connections that are done, or all of them when stopping
+    void reap(bool all) {
+        for (size_t i = 0; i < conns.size();) {
+            connection *c = conns[i];
+            if (all && !c->finished.load()) {
+                shutdown(c->fd, SHUT_RD);
+            }
+            if (all || c->finished.load()) {
+                c->worker.join();
+                delete c;
+                conns[i] = conns.back();
+                conns.pop_back();
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    // no more requests can join the batch, mtx is held
+    bool full() const {
+        return int(pending.size()) >= maxBatch || int(pending.size()) >= opened;
+    }
+
+    void batchLoop() {
+        Matrix<float, Dynamic, INPUT, RowMajor> inputs(maxBatch, INPUT);
+        Matrix<float, Dynamic, OUTPUT> outputs(maxBatch, OUTPUT);
+        std::vector<request *> taken;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                queued.wait(lk, [this] { return closing || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+                auto deadline = pending.front()->arrived + std::chrono::microseconds(maxWait);
+                queued.wait_until(lk, deadline, [this] { return closing || full(); });
+                int n = int(pending.size()) < maxBatch ? pending.size() : maxBatch;
+                taken.assign(pending.begin(), pending.begin() + n);
+                pending.erase(pending.begin(), pending.begin() + n);
+            }
+            int n = taken.size();
+            for (int i = 0; i < n; ++i) {
+                convert_pixels(taken[i]->pixels, inputs.row(i).data(), INPUT);
+            }
+            tr.predict(inputs.topRows(n), outputs);
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                for (int i = 0; i < n; ++i) {
+                    for (int j = 0; j < OUTPUT; ++j) {
+                        taken[i]->outputs[j] = outputs(i, j);
+                    }
+                    taken[i]->done = true;
+                    taken[i]->answered.notify_one();
+                }
+            }
+            std::lock_guard<std::mutex> lk(stats);
+            ++batches;
+            batched += n;
+        }
+    }
+
+    const T &tr;
+    int maxBatch;
+    int maxWait;
+    int listener;
+    std::string path;
+    std::atomic<bool> stopping;
+    std::vector<connection *> conns;
+    std::mutex mtx;
+    std::condition_variable queued;
+    std::deque<request *> pending;
+    int opened;
+    bool closing;
+    std::mutex stats;
+    latency_histogram latency;
+    size_t batches;
+    size_t batched;
+    std::atomic<size_t> served;
+    std::chrono::steady_clock::time_point first;
+    std::chrono::steady_clock::time_point last;
+};
+
+#endif
@@ -0,0 +1,196 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_SPARSE_H
+#define MNIST_SPARSE_H
+
+#include <vector>
+#include <cstdint>
+#include <immintrin.h>
+#include "dataset.h"
+#include "kernels.h"
+#include "half.h"
+
+// in auto mode the first layer kernel is picked by timing both, see
+// sparse_is_faster in train.h
+enum sparse_mode
+{
+    SPARSE_AUTO,
+    SPARSE_ON,
+    SPARSE_OFF
+};
+
+inline const char *sparse_mode_name(int mode)
+{
+    switch (mode) {
+    case SPARSE_ON:
+        return "on";
+    case SPARSE_OFF:
+        return "off";
+    default:
+        return "auto";
+    }
+}
+
+// compressed rows of raw pixels, the nonzero pixels of row i are at
+// [start[i], start[i + 1]) of index and value. values are PIXEL_SCALE * p,
+// the PIXEL_BIAS part of the normalized pixels is handled by the trainer
+// as a rank one term, so all the zero pixels can be skipped
+struct sparse_rows
+{
+    sparse_rows() : start(1, 0) {
+    }
+
+    int rows() const {
+        return start.size() - 1;
+    }
+
+    size_t nonzeros() const {
+        return index.size();
+    }
+
+    // the capacity is kept, so refilling a batch does not allocate
+    void clear() {
+        start.resize(1);
+        index.clear();
+        value.clear();
+    }
+
+    void append(const unsigned char *px, int n) {
+        for (int t = 0; t < n; ++t) {
+            if (px[t]) {
+                index.push_back(t);
+                value.push_back(px[t] * PIXEL_SCALE);
+            }
+        }
+        start.push_back(index.size());
+    }
+
+    // the entries of rows [first, first + n) by column, into out: out.start
+    // gets cols + 1 entries and out.index the row numbers counted from first
+    void transpose(int first, int n, int cols, sparse_rows &out) const {
+        uint32_t b = start[first], e = start[first + n];
+        out.start.assign(cols + 1, 0);
+        out.index.resize(e - b);
+        out.value.resize(e - b);
+        for (uint32_t p = b; p < e; ++p) {
+            ++out.start[index[p] + 1];
+        }
+        for (int k = 0; k < cols; ++k) {
+            out.start[k + 1] += out.start[k];
+        }
+        // start[k] is used as the cursor of column k, which leaves it at
+        // the start of column k + 1, shifted back below
+        for (int i = 0; i < n; ++i) {
+            for (uint32_t p = start[first + i]; p < start[first + i + 1]; ++p) {
+                uint32_t q = out.start[index[p]]++;
+                out.index[q] = i;
+                out.value[q] = value[p];
+            }
+        }
+        for (int k = cols; k > 0; --k) {
+            out.start[k] = out.start[k - 1];
+        }
+        out.start[0] = 0;
+    }
+
+    std::vector<uint32_t> start;
+    std::vector<uint16_t> index;
+    std::vector<float> value;
+};
+
+// y[j] = sum over p < count of value[p] * x[index[p] * LD + j], for j < W,
+// or y[j] += that when ADD. the W outputs stay in registers while the
+// rows of x are streamed, the last partial vector is masked. x is stored
+// in precision P, half rows are widened as they are loaded
+template<int W, int LD, bool ADD, int P, typename I>
+inline void sparse_combine_block(const I *index, const float *value, int count, const typename half_traits<P>::type *x, float *y)
+{
+    typedef half_traits<P> H;
+#ifdef __AVX2__
+    enum { V = W / 8, T = W % 8 };
+    const __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(T), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256 acc[V + 1];
+    for (int v = 0; v < V; ++v) {
+        acc[v] = ADD ? _mm256_loadu_ps(y + v * 8) : _mm256_setzero_ps();
+    }
+    if (T != 0) {
+        acc[V] = ADD ? _mm256_maskload_ps(y + V * 8, mask) : _mm256_setzero_ps();
+    }
+    for (int p = 0; p < count; ++p) {
+        const typename H::type *r = x + size_t(index[p]) * LD;
+        __m256 s = _mm256_set1_ps(value[p]);
+        for (int v = 0; v < V; ++v) {
+            acc[v] = MM256_FMADD(s, H::widen8(r + v * 8), acc[v]);
+        }
+        if (T != 0) {
+            acc[V] = MM256_FMADD(s, H::widen8(r + V * 8, mask), acc[V]);
+        }
+    }
+    for (int v = 0; v < V; ++v) {
+        _mm256_storeu_ps(y + v * 8, acc[v]);
+    }
+    if (T != 0) {
+        _mm256_maskstore_ps(y + V * 8, mask, acc[V]);
+    }
+#else
+    if (!ADD) {
+        for (int j = 0; j < W; ++j) {
+            y[j] = 0;
+        }
+    }
+    for (int p = 0; p < count; ++p) {
+        const typename H::type *r = x + size_t(index[p]) * LD;
+        for (int j = 0; j < W; ++j) {
+            y[j] += value[p] * H::widen(r[j]);
+        }
+    }
+#endif
+}
+
+// the same over rows of N values, 64 outputs at a time
+template<int N, bool ADD, int P = PREC_FP32, typename I>
+inline void sparse_combine(const I *index, const float *value, int count, const typename half_traits<P>::type *x, float *y)
+{
+    int j = 0;
+    for (; j + 64 <= N; j += 64) {
+        sparse_combine_block<64, N, ADD, P>(index, value, count, x + j, y + j);
+    }
+    if (N % 64) {
+        sparse_combine_block<N % 64, N, ADD, P>(index, value, count, x + j, y + j);
+    }
+}
+
+// fraction of nonzero pixels in up to sample records spread over data
+inline double pixel_density(const dataset &data, size_t sample = 1000)
+{
+    size_t n = data.size() < sample ? data.size() : sample;
+    size_t nonzeros = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned char *px = data.pixels(i * data.size() / n);
+        for (int t = 0; t < dataset::PIXELS; ++t) {
+            nonzeros += px[t] != 0;
+        }
+    }
+    return n ? double(nonzeros) / (n * dataset::PIXELS) : 1;
+}
+
+#endif
@@ -0,0 +1,802 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_STREAM_H
+#define MNIST_STREAM_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <random>
+#include <memory>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "trainer.h"
+#include "dataset.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+// a blocking fifo between two pipeline stages, pop() returns false once
+// the queue is closed and drained
+template<typename T>
+class bounded_queue
+{
+public:
+    bounded_queue() : closed(false) {
+    }
+
+    void push(const T &v) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            items.push_back(v);
+        }
+        cv.notify_one();
+    }
+
+    // adds the seconds spent waiting to waited
+    bool pop(T &v, double &waited) {
+        std::unique_lock<std::mutex> lk(mtx);
+        if (items.empty() && !closed) {
+            auto bt = std::chrono::steady_clock::now();
+            cv.wait(lk, [this] { return closed || !items.empty(); });
+            waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+        }
+        if (items.empty()) {
+            return false;
+        }
+        v = items.front();
+        items.pop_front();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            closed = true;
+        }
+        cv.notify_all();
+    }
+
+protected:
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<T> items;
+    bool closed;
+};
+
+// reads the records of a csv or binary dataset in order, a few at a time,
+// so a file of any size is read with a fixed amount of memory. labels of
+// malformed csv rows are -1, blank lines are skipped
+class record_stream
+{
+public:
+    enum { CHUNK = 1 << 20 };
+
+    record_stream() : fd(-1), binary(false), count(0), next(0), labels(0), pixels(0), begin(0), end(0), eof(false), bytes(0), labeled(false) {
+    }
+
+    record_stream(const record_stream &) = delete;
+    record_stream &operator=(const record_stream &) = delete;
+
+    ~record_stream() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int open(const char *path) {
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        dataset_header h;
+        binary = pread(fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(h.magic, "MNISTDS", 8) == 0;
+        if (binary) {
+            if (h.version != dataset::VERSION || h.dim != dataset::PIXELS) {
+                std::cout << "invalid dataset: " << path << std::endl;
+                return -1;
+            }
+            count = h.count;
+            labels = h.labels;
+            pixels = h.pixels;
+        } else {
+            buffer.resize(CHUNK);
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        }
+        return 0;
+    }
+
+    // read up to max records into px and label, returns how many were
+    // read, 0 at the end and -1 on a read error
+    int read(unsigned char *px, int *label, int max) {
+        return binary ? readBinary(px, label, max) : readCsv(px, label, max);
+    }
+
+    // bytes read so far
+    size_t bytesRead() const {
+        return bytes;
+    }
+
+    bool isBinary() const {
+        return binary;
+    }
+
+    // records in a binary dataset, 0 for csv
+    size_t records() const {
+        return count;
+    }
+
+    // continue a binary dataset at record i
+    void seek(size_t i) {
+        next = i < count ? i : count;
+    }
+
+    // csv rows without a label are malformed, for training
+    void setLabeled(bool on) {
+        labeled = on;
+    }
+
+protected:
+    int readBinary(unsigned char *px, int *label, int max) {
+        int n = count - next < size_t(max) ? count - next : max;
+        if (n == 0) {
+            return 0;
+        }
+        unsigned char l[4096];
+        for (int b = 0; b < n; b += sizeof(l)) {
+            int m = n - b < int(sizeof(l)) ? n - b : sizeof(l);
+            if (readAt(l, m, labels + next + b) < 0) {
+                return -1;
+            }
+            for (int i = 0; i < m; ++i) {
+                label[b + i] = l[i];
+            }
+        }
+        if (readAt(px, size_t(n) * dataset::PIXELS, pixels + next * dataset::PIXELS) < 0) {
+            return -1;
+        }
+        next += n;
+        return n;
+    }
+
+    int readAt(void *p, size_t n, size_t offset) {
+        char *c = static_cast<char *>(p);
+        while (n > 0) {
+            ssize_t r = pread(fd, c, n, offset);
+            if (r < 0 && errno == EINTR) {
+                continue;
+            }
+            if (r <= 0) {
+                return -1;
+            }
+            c += r;
+            n -= r;
+            offset += r;
+            bytes += r;
+        }
+        return 0;
+    }
+
+    int readCsv(unsigned char *px, int *label, int max) {
+        int n = 0;
+        while (n < max) {
+            const char *p = buffer.data() + begin;
+            const void *nl = memchr(p, '\n', end - begin);
+            if (!nl && !eof) {
+                if (fill() < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            size_t length = nl ? static_cast<const char *>(nl) - p : end - begin;
+            if (!nl && length == 0) {
+                break;
+            }
+            begin += nl ? length + 1 : length;
+            if (length > 0 && p[length - 1] == '\r') {
+                --length;
+            }
+            if (length == 0) {
+                continue;
+            }
+            label[n] = parse_row(p, length, px + size_t(n) * dataset::PIXELS, labeled);
+            ++n;
+        }
+        return n;
+    }
+
+    // move the partial line to the front and read more behind it, the
+    // buffer only grows for a line longer than it
+    int fill() {
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        ssize_t r;
+        do {
+            r = ::read(fd, buffer.data() + end, buffer.size() - end);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            return -1;
+        }
+        eof = r == 0;
+        end += r;
+        bytes += r;
+        return 0;
+    }
+
+    int fd;
+    bool binary;
+    size_t count;
+    size_t next;
+    size_t labels;
+    size_t pixels;
+    std::vector<char> buffer;
+    size_t begin;
+    size_t end;
+    bool eof;
+    size_t bytes;
+    bool labeled;
+};
+
+// reads the records appended to a file that keeps growing, from its start.
+// a csv file has one labeled record per line, a binary one starts with the
+// 8 bytes "MNISTRS" and has 785 bytes per record, the label then the
+// pixels. a record is only read once it is complete, the end of the file
+// is never taken as the end of the records
+class tail_stream
+{
+public:
+    enum { CHUNK = 1 << 16, RECORD = 1 + dataset::PIXELS };
+
+    tail_stream() : fd(-1), binary(false), known(false), begin(0), end(0), bytes(0), malformed(0) {
+        buffer.resize(CHUNK);
+    }
+
+    tail_stream(const tail_stream &) = delete;
+    tail_stream &operator=(const tail_stream &) = delete;
+
+    ~tail_stream() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    int open(const char *path) {
+        fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // read up to max of the complete records appended so far into px and
+    // label, returns how many were read, 0 when there is nothing new yet
+    // and -1 on a read error
+    int poll(unsigned char *px, int *label, int max) {
+        int n = 0;
+        while (n < max) {
+            int m = binary ? takeBinary(px + size_t(n) * dataset::PIXELS, label + n, max - n) : takeCsv(px + size_t(n) * dataset::PIXELS, label + n, max - n);
+            n += m;
+            if (n == max) {
+                break;
+            }
+            int r = fill();
+            if (r < 0) {
+                return -1;
+            }
+            if (r == 0) {
+                break;
+            }
+        }
+        return n;
+    }
+
+    size_t bytesRead() const {
+        return bytes;
+    }
+
+    // csv rows skipped for not having a label and 784 pixels
+    size_t malformedRows() const {
+        return malformed;
+    }
+
+protected:
+    int takeBinary(unsigned char *px, int *label, int max) {
+        int n = 0;
+        while (n < max && end - begin >= size_t(RECORD)) {
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(buffer.data() + begin);
+            label[n] = p[0];
+            memcpy(px + size_t(n) * dataset::PIXELS, p + 1, dataset::PIXELS);
+            begin += RECORD;
+            ++n;
+        }
+        return n;
+    }
+
+    int takeCsv(unsigned char *px, int *label, int max) {
+        int n = 0;
+        while (n < max) {
+            const char *p = buffer.data() + begin;
+            const void *nl = memchr(p, '\n', end - begin);
+            if (!nl) {
+                break;
+            }
+            size_t length = static_cast<const char *>(nl) - p;
+            begin += length + 1;
+            if (length > 0 && p[length - 1] == '\r') {
+                --length;
+            }
+            if (length == 0) {
+                continue;
+            }
+            if (std::count(p, p + length, ',') != dataset::PIXELS) {
+                ++malformed;
+                continue;
+            }
+            label[n] = parse_line(p, length, px + size_t(n) * dataset::PIXELS);
+            ++n;
+        }
+        return n;
+    }
+
+    // read what was appended behind the partial record, returns the bytes
+    // read. the format is known once the first 8 bytes are there
+    int fill() {
+        memmove(buffer.data(), buffer.data() + begin, end - begin);
+        end -= begin;
+        begin = 0;
+        if (end == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+        ssize_t r;
+        do {
+            r = ::read(fd, buffer.data() + end, buffer.size() - end);
+        } while (r < 0 && errno == EINTR);
+        if (r < 0) {
+            return -1;
+        }
+        end += r;
+        bytes += r;
+        if (!known && end >= 8) {
+            known = true;
+            binary = memcmp(buffer.data(), "MNISTRS", 8) == 0;
+            if (binary) {
+                begin = 8;
+            }
+        }
+        return r;
+    }
+
+    int fd;
+    bool binary;
+    bool known;
+    std::vector<char> buffer;
+    size_t begin;
+    size_t end;
+    size_t bytes;
+    size_t malformed;
+};
+
+// the peak resident memory of the process
+inline double peak_rss_mb()
+{
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss / 1024.0;
+}
+
+// trains on a dataset file larger than memory: an epoch is read window by
+// window of at most window records, on a thread, into depth buffers that
+// are reused, so resident memory is fixed. a binary dataset is split into
+// blocks of window / 8 records, which are read in a new order every epoch,
+// and each window is handed out as a dataset, for its records to be
+// shuffled again by a batch_source. a csv file can only be read in order,
+// records are then only shuffled within a window. malformed csv rows and
+// rows without a label are dropped and counted
+class window_stream
+{
+public:
+    enum { BLOCKS = 8 };
+
+    window_stream(size_t window, int depth = 2) : window(window > 0 ? window : 1), block(window / BLOCKS > 0 ? window / BLOCKS : 1), binary(false), count(0), slots(depth > 1 ? depth : 2), held(nullptr), failed(false), dropped(0), waited(0) {
+    }
+
+    window_stream(const window_stream &) = delete;
+    window_stream &operator=(const window_stream &) = delete;
+
+    ~window_stream() {
+        finish();
+    }
+
+    int open(const char *source) {
+        path = source;
+        record_stream rs;
+        if (rs.open(source) < 0) {
+            return -1;
+        }
+        binary = rs.isBinary();
+        count = rs.records();
+        for (auto &w : slots) {
+            w.labels.resize(window);
+            w.pixels.resize(window * dataset::PIXELS);
+            w.parsed.resize(window);
+        }
+        return 0;
+    }
+
+    // records of a binary dataset, 0 for csv
+    size_t records() const {
+        return count;
+    }
+
+    // whether the window order changes between epochs
+    bool blockShuffled() const {
+        return binary;
+    }
+
+    // start reading epoch lp, the block order only depends on lp
+    void epoch(int lp) {
+        finish();
+        failed = false;
+        freed.reset(new bounded_queue<slot *>());
+        staged.reset(new bounded_queue<slot *>());
+        for (auto &w : slots) {
+            freed->push(&w);
+        }
+        producer = std::thread(&window_stream::produce, this, lp);
+    }
+
+    // the next window of the epoch, nullptr after the last one. the window
+    // returned before is handed back to the reader
+    const dataset *next() {
+        if (held) {
+            freed->push(held);
+            held = nullptr;
+        }
+        if (!staged->pop(held, waited)) {
+            return nullptr;
+        }
+        return &held->data;
+    }
+
+    // a read failed during the last epoch
+    bool readFailed() const {
+        return failed;
+    }
+
+    // seconds spent waiting for a window to be read
+    double waitSeconds() const {
+        return waited;
+    }
+
+    // csv rows dropped in all epochs so far
+    size_t malformedRows() const {
+        return dropped;
+    }
+
+protected:
+    struct slot
+    {
+        std::vector<unsigned char> labels;
+        std::vector<unsigned char> pixels;
+        std::vector<int> parsed;
+        dataset data;
+    };
+
+    void finish() {
+        if (producer.joinable()) {
+            freed->close();
+            producer.join();
+        }
+        held = nullptr;
+    }
+
+    void produce(int lp) {
+        record_stream rs;
+        if (rs.open(path.c_str()) < 0) {
+            failed = true;
+            staged->close();
+            return;
+        }
+        rs.setLabeled(true);
+        std::vector<size_t> order;
+        if (binary) {
+            order.resize((count + block - 1) / block);
+            for (size_t i = 0; i < order.size(); ++i) {
+                order[i] = i;
+            }
+            std::mt19937 rng(lp);
+            std::shuffle(order.begin(), order.end(), rng);
+        }
+        size_t q = 0;
+        slot *w;
+        double ignored = 0;
+        while (freed->pop(w, ignored)) {
+            size_t rows = 0;
+            int got = 0;
+            if (binary) {
+                for (; rows < window && q < order.size(); ++q) {
+                    size_t first = order[q] * block;
+                    size_t n = count - first < block ? count - first : block;
+                    if (rows + n > window) {
+                        break;
+                    }
+                    rs.seek(first);
+                    if ((got = rs.read(&w->pixels[rows * dataset::PIXELS], &w->parsed[rows], n)) < 0) {
+                        break;
+                    }
+                    rows += got;
+                }
+            } else if ((got = rs.read(w->pixels.data(), w->parsed.data(), window)) > 0) {
+                rows = got;
+            }
+            if (got < 0) {
+                failed = true;
+            }
+            // drop malformed csv rows
+            size_t kept = 0;
+            for (size_t i = 0; i < rows; ++i) {
+                if (w->parsed[i] < 0) {
+                    ++dropped;
+                    continue;
+                }
+                if (kept != i) {
+                    memcpy(&w->pixels[kept * dataset::PIXELS], &w->pixels[i * dataset::PIXELS], dataset::PIXELS);
+                }
+                w->labels[kept++] = w->parsed[i];
+            }
+            if (rows == 0) {
+                break;
+            }
+            // a window of nothing but dropped rows has nothing to train,
+            // read the next one into the same slot
+            if (kept == 0) {
+                freed->push(w);
+                continue;
+            }
+            w->data.view(w->labels.data(), w->pixels.data(), kept);
+            staged->push(w);
+        }
+        staged->close();
+    }
+
+    std::string path;
+    size_t window;
+    size_t block;
+    bool binary;
+    size_t count;
+    std::vector<slot> slots;
+    std::unique_ptr<bounded_queue<slot *>> freed;
+    std::unique_ptr<bounded_queue<slot *>> staged;
+    std::thread producer;
+    slot *held;
+    std::atomic<bool> failed;
+    std::atomic<size_t> dropped;
+    double waited;
+};
+
+// scores the records of a file into another in three overlapped stages: a
+// reader thread stages batches of records, the calling thread scores them
+// on the pool and a writer thread writes the predictions, one line per
+// record in input order, "<label>" or "<label>,<p0>,...,<p9>" with probs,
+// "error" for a malformed row. depth batch buffers circulate between the
+// stages, so memory doesn't depend on the size of the input. the output is
+// written to "<out>.tmp" and renamed when complete
+template<typename T>
+class stream_scorer
+{
+public:
+    enum { INPUT = dataset::PIXELS, OUTPUT = 10 };
+
+    stream_scorer(const T &tr, thread_pool &pool, int batch = 1024, bool probs = false, int depth = 3) : tr(tr), pool(pool), size(batch > 0 ? batch : 1), probs(probs), slots(depth > 2 ? depth : 2), records(0), bytes(0), errors(0), starved(0), idle(0) {
+    }
+
+    int score(const char *in, const char *out) {
+        record_stream rs;
+        if (rs.open(in) < 0) {
+            return -1;
+        }
+        std::string tmp = std::string(out) + ".tmp";
+        int ofd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (ofd < 0) {
+            std::cout << "cannot open: " << tmp << std::endl;
+            return -1;
+        }
+        for (auto &s : slots) {
+            s.pixels.resize(size_t(size) * INPUT);
+            s.labels.resize(size);
+        }
+        std::vector<Matrix<float, Dynamic, INPUT, RowMajor>> inputs(pool.size());
+        std::vector<Matrix<float, Dynamic, OUTPUT>> outputs(pool.size());
+        bounded_queue<slot *> freed, staged, scored;
+        for (auto &s : slots) {
+            freed.push(&s);
+        }
+        // a read or write error stops all three stages, the batches
+        // already in flight are dropped
+        std::atomic<bool> failed(false);
+        double ignored = 0;
+        std::thread reader([&]() {
+            slot *s;
+            while (!failed && freed.pop(s, ignored)) {
+                s->rows = rs.read(s->pixels.data(), s->labels.data(), size);
+                if (s->rows <= 0) {
+                    if (s->rows < 0) {
+                        failed = true;
+                    }
+                    break;
+                }
+                staged.push(s);
+            }
+            staged.close();
+        });
+        std::thread writer([&]() {
+            slot *s;
+            while (scored.pop(s, idle)) {
+                if (failed) {
+                    continue;
+                }
+                if (!writeAll(ofd, s->text.data(), s->text.size())) {
+                    failed = true;
+                    freed.close();
+                    continue;
+                }
+                freed.push(s);
+            }
+        });
+        slot *s;
+        while (staged.pop(s, starved)) {
+            if (failed) {
+                continue;
+            }
+            int n = s->rows;
+            int tasks = pool.size() < n ? pool.size() : n;
+            pool.run(tasks, [&](int t) {
+                int b = n * t / tasks, e = n * (t + 1) / tasks;
+                Matrix<float, Dynamic, INPUT, RowMajor> &m = inputs[t];
+                if (m.rows() != e - b) {
+                    m.resize(e - b, INPUT);
+                }
+                for (int i = b; i < e; ++i) {
+                    convert_pixels(&s->pixels[size_t(i) * INPUT], m.row(i - b).data(), INPUT);
+                }
+                tr.predict(m, outputs[t]);
+            });
+            format(*s, tasks, outputs);
+            records += n;
+            scored.push(s);
+        }
+        scored.close();
+        reader.join();
+        writer.join();
+        bytes = rs.bytesRead();
+        if (close(ofd) < 0 || failed || rename(tmp.c_str(), out) < 0) {
+            std::cout << "cannot write: " << out << std::endl;
+            unlink(tmp.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+    size_t recordsScored() const {
+        return records;
+    }
+
+    size_t bytesRead() const {
+        return bytes;
+    }
+
+    size_t malformed() const {
+        return errors;
+    }
+
+    // seconds scoring waited for a batch to be read
+    double readWaitSeconds() const {
+        return starved;
+    }
+
+    // seconds the writer waited for a batch to be scored
+    double writeWaitSeconds() const {
+        return idle;
+    }
+
+protected:
+    struct slot
+    {
+        slot() : rows(0) {
+        }
+
+        std::vector<unsigned char> pixels;
+        std::vector<int> labels;
+        int rows;
+        std::string text;
+    };
+
+    static bool writeAll(int fd, const char *p, size_t n) {
+        while (n > 0) {
+            ssize_t w = write(fd, p, n);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return false;
+            }
+            p += w;
+            n -= w;
+        }
+        return true;
+    }
+
+    void format(slot &s, int tasks, const std::vector<Matrix<float, Dynamic, OUTPUT>> &outputs) {
+        s.text.clear();
+        char line[32 * (OUTPUT + 1)];
+        int n = s.rows;
+        for (int t = 0; t < tasks; ++t) {
+            int b = n * t / tasks;
+            const Matrix<float, Dynamic, OUTPUT> &o = outputs[t];
+            for (int i = 0; i < o.rows(); ++i) {
+                if (s.labels[b + i] < 0) {
+                    s.text += "error\n";
+                    ++errors;
+                    continue;
+                }
+                int label;
+                o.row(i).maxCoeff(&label);
+                int k = snprintf(line, sizeof(line), "%d", label);
+                for (int j = 0; probs && j < OUTPUT; ++j) {
+                    k += snprintf(line + k, sizeof(line) - k, ",%g", o(i, j));
+                }
+                line[k++] = '\n';
+                s.text.append(line, k);
+            }
+        }
+    }
+
+    const T &tr;
+    thread_pool &pool;
+    int size;
+    bool probs;
+    std::vector<slot> slots;
+    size_t records;
+    size_t bytes;
+    size_t errors;
+    double starved;
+    double idle;
+};
+
+#endif
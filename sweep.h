@@ -0,0 +1,202 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#ifndef MNIST_SWEEP_H
+#define MNIST_SWEEP_H
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include "dataset.h"
+#include "pipeline.h"
+#include "network.h"
+#include "train.h"
+#include "evaluate.h"
+#include "thread_pool.h"
+
+// one network of a sweep and how it did
+struct sweep_result
+{
+    std::vector<int> layers;
+    float rate;
+    double accuracy;
+    double seconds;
+    size_t samples;
+};
+
+// trains several networks at once, one per pool thread, all of them
+// reading the same loaded records. the last holdout records are held out
+// of training and every network is scored on them after its epochs. the
+// records are never copied: both parts are views of the dataset and each
+// network only shuffles its own order of indexes
+class sweeper
+{
+public:
+    enum { BATCH = 50 };
+
+    sweeper(const dataset &data, size_t holdout, int epochs, int threads) : pool(threads), epochs(epochs), best(-1), elapsed(0) {
+        size_t n = data.size() - holdout;
+        train.view(data.labels(), data.pixels(0), n);
+        held.view(data.labels() + n, data.pixels(n), holdout);
+    }
+
+    void add(const std::vector<int> &layers, float rate) {
+        sweep_result r;
+        r.layers = layers;
+        r.rate = rate;
+        r.accuracy = 0;
+        r.seconds = 0;
+        r.samples = 0;
+        results.push_back(r);
+    }
+
+    int threads() const {
+        return pool.size();
+    }
+
+    // train and score all the networks, the best one is saved to path
+    // unless it's empty. the results are then ranked by accuracy, the
+    // faster first on a tie
+    int run(const std::string &path) {
+        std::atomic<size_t> next(0);
+        int failed = 0;
+        auto bt = std::chrono::steady_clock::now();
+        pool.run(pool.size(), [&](int) {
+            thread_pool serial(1);
+            for (size_t i = next++; i < results.size(); i = next++) {
+                if (with_network(results[i].layers, results[i].rate, trial{this, i, &serial, &path}) < 0) {
+                    std::lock_guard<std::mutex> lk(mtx);
+                    ++failed;
+                }
+            }
+        });
+        elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+        std::stable_sort(results.begin(), results.end(), [](const sweep_result &a, const sweep_result &b) {
+            return a.accuracy > b.accuracy || (a.accuracy == b.accuracy && a.seconds < b.seconds);
+        });
+        return failed > 0 ? -1 : 0;
+    }
+
+    const std::vector<sweep_result> &ranked() const {
+        return results;
+    }
+
+    size_t trainRecords() const {
+        return train.size();
+    }
+
+    size_t heldRecords() const {
+        return held.size();
+    }
+
+    // wall seconds of the whole sweep
+    double seconds() const {
+        return elapsed;
+    }
+
+    // the seconds of all the networks over the wall seconds, how many ran
+    // at once on average
+    double concurrency() const {
+        double sum = 0;
+        for (auto &r : results) {
+            sum += r.seconds;
+        }
+        return elapsed > 0 ? sum / elapsed : 0;
+    }
+
+    void print(std::ostream &os) const {
+        os << "rank" << std::setw(20) << "layers" << std::setw(8) << "rate" << std::setw(10) << "accuracy"
+           << std::setw(10) << "seconds" << std::setw(12) << "samples/s" << std::endl;
+        for (size_t i = 0; i < results.size(); ++i) {
+            const sweep_result &r = results[i];
+            os << std::setw(4) << i + 1 << std::setw(20) << topology_name(r.layers) << std::setw(8) << r.rate
+               << std::setw(10) << r.accuracy << std::setw(10) << r.seconds << std::setw(12)
+               << (r.seconds > 0 ? r.samples / r.seconds : 0) << std::endl;
+        }
+    }
+
+protected:
+    // trains results[index] on the calling pool thread
+    struct trial
+    {
+        sweeper *sw;
+        size_t index;
+        thread_pool *serial;
+        const std::string *path;
+
+        template<typename T>
+        int operator()(T &tr) const {
+            return sw->trainOne(tr, index, *serial, *path);
+        }
+    };
+
+    template<typename T>
+    int trainOne(T &tr, size_t index, thread_pool &serial, const std::string &path) {
+        sweep_result &r = results[index];
+        tr.randomize(index);
+        batch_source source(train, BATCH, true, index);
+        source.setSparse(sparse_is_faster(tr, train, BATCH));
+        batch b;
+        auto bt = std::chrono::steady_clock::now();
+        for (int lp = 0; lp < epochs; ++lp) {
+            source.epoch(lp);
+            for (size_t q = 0; q < source.batches(); ++q) {
+                source.fill(q, b);
+                if (source.isSparse()) {
+                    tr.train(b.sparse, b.targets);
+                } else {
+                    tr.train(b.inputs, b.targets);
+                }
+            }
+        }
+        r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+        r.samples = train.size() * epochs;
+        r.accuracy = evaluate(tr, held, held.size(), serial).accuracy();
+        std::lock_guard<std::mutex> lk(mtx);
+        std::cout << "trained " << topology_name(r.layers) << " rate " << r.rate << ": accuracy " << r.accuracy
+                  << ", " << r.seconds << "sec(s)" << std::endl;
+        if (best < 0 || r.accuracy > results[best].accuracy ||
+            (r.accuracy == results[best].accuracy && r.seconds < results[best].seconds)) {
+            best = index;
+            if (!path.empty() && tr.saveModel(path.c_str()) < 0) {
+                std::cout << "cannot save: " << path << std::endl;
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    thread_pool pool;
+    dataset train;
+    dataset held;
+    int epochs;
+    std::vector<sweep_result> results;
+    std::mutex mtx;
+    long best;
+    double elapsed;
+};
+
+#endif
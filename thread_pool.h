@@ -0,0 +1,149 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_THREAD_POOL_H
+#define MNIST_THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// a fixed set of worker threads running fork-join jobs: run() hands out
+// task indexes [0, tasks) to the workers and the calling thread, and
+// returns when all of them are done. the job is passed to the workers by
+// pointer, so running one never allocates
+class thread_pool
+{
+public:
+    explicit thread_pool(int threads = 0) : stop(false), generation(0), job(nullptr), call(nullptr), tasks(0), pending(0) {
+        if (threads <= 0) {
+            threads = hardware();
+        }
+        for (int i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(&thread_pool::loop, this));
+        }
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers) {
+            t.join();
+        }
+    }
+
+    int size() const {
+        return workers.size() + 1;
+    }
+
+    template<typename F>
+    void run(int n, const F &fn) {
+        if (n <= 0) {
+            return;
+        }
+        if (workers.empty() || n == 1) {
+            for (int i = 0; i < n; ++i) {
+                fn(i);
+            }
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            job = &fn;
+            call = &invoke<F>;
+            tasks = n;
+            next.store(0);
+            pending = workers.size();
+            ++generation;
+        }
+        cv.notify_all();
+        work(&fn, &invoke<F>, n);
+        std::unique_lock<std::mutex> lk(mtx);
+        done.wait(lk, [this] { return pending == 0; });
+        job = nullptr;
+        call = nullptr;
+    }
+
+    static int hardware() {
+        int n = std::thread::hardware_concurrency();
+        return n > 0 ? n : 1;
+    }
+
+protected:
+    template<typename F>
+    static void invoke(const void *fn, int i) {
+        (*static_cast<const F *>(fn))(i);
+    }
+
+    void work(const void *fn, void (*f)(const void *, int), int n) {
+        int i;
+        while ((i = next.fetch_add(1)) < n) {
+            f(fn, i);
+        }
+    }
+
+    void loop() {
+        unsigned long seen = 0;
+        while (true) {
+            const void *fn;
+            void (*f)(const void *, int);
+            int n;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [this, seen] { return stop || generation != seen; });
+                if (stop) {
+                    return;
+                }
+                seen = generation;
+                fn = job;
+                f = call;
+                n = tasks;
+            }
+            work(fn, f, n);
+            {
+                std::lock_guard<std::mutex> lk(mtx);
+                --pending;
+            }
+            done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::condition_variable done;
+    bool stop;
+    unsigned long generation;
+    const void *job;
+    void (*call)(const void *, int);
+    int tasks;
+    int pending;
+    std::atomic<int> next;
+};
+
+#endif
@@ -0,0 +1,281 @@
+// Copyright (c) 2019 Youlin Feng <fengyoulin@foxmail.com>
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef MNIST_TRAIN_H
+#define MNIST_TRAIN_H
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include "trainer.h"
+#include "dataset.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+enum train_mode
+{
+    TRAIN_SERIAL,
+    TRAIN_SYNC,
+    TRAIN_HOGWILD
+};
+
+inline const char *train_mode_name(int mode)
+{
+    switch (mode) {
+    case TRAIN_SYNC:
+        return "sync";
+    case TRAIN_HOGWILD:
+        return "hogwild";
+    default:
+        return "serial";
+    }
+}
+
+// the mode an epoch of mode runs in with weights of precision prec: the
+// half precisions train hogwild epochs in sync mode, see parallel_trainer
+inline int effective_train_mode(int mode, int prec)
+{
+    return mode == TRAIN_HOGWILD && prec != PREC_FP32 ? int(TRAIN_SYNC) : mode;
+}
+
+// runs training epochs over a dataset, on several threads. in sync mode each
+// batch is split into one row shard per thread, the shard gradients are
+// summed and applied once, which is the same update as a serial step on
+// the whole batch. in hogwild mode every thread trains its own batches and
+// writes into the shared weights without locking. the half precisions
+// convert the master weights into their half copies after every update,
+// which has to happen with no product running, so they train hogwild
+// epochs in sync mode. T is a trainer or a layer_network.
+template<typename T>
+class parallel_trainer
+{
+public:
+    typedef typename T::workspace workspace;
+
+    parallel_trainer(T &tr, int threads) : tr(tr), pool(threads), prefetch(3), halted(false), waited(0), stalled(0) {
+        for (int i = 0; i < pool.size(); ++i) {
+            ws.push_back(new workspace());
+        }
+    }
+
+    ~parallel_trainer() {
+        for (auto p : ws) {
+            delete p;
+        }
+    }
+
+    int threads() const {
+        return pool.size();
+    }
+
+    template<typename D1, typename D2>
+    void trainSync(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets) {
+        int rows = inputs.rows();
+        int shards = pool.size() < rows ? pool.size() : rows;
+        pool.run(shards, [&](int k) {
+            int b = rows * k / shards, e = rows * (k + 1) / shards;
+            tr.gradient(inputs.middleRows(b, e - b), targets.middleRows(b, e - b), *ws[k]);
+        });
+        reduce(shards);
+    }
+
+    template<typename D>
+    void trainSync(const sparse_rows &inputs, const MatrixBase<D> &targets) {
+        int rows = targets.rows();
+        int shards = pool.size() < rows ? pool.size() : rows;
+        pool.run(shards, [&](int k) {
+            int b = rows * k / shards, e = rows * (k + 1) / shards;
+            tr.gradient(inputs, b, targets.middleRows(b, e - b), *ws[k]);
+        });
+        reduce(shards);
+    }
+
+    // one pass over the batches of source, calls progress(trained) with
+    // the records of the epoch trained so far, skipped ones included. in
+    // serial and sync mode that is after every batch. in hogwild mode every
+    // thread stages and trains its own batches, progress is called by the
+    // thread of task 0 after each of its batches with the records of the
+    // batches before the first one not trained yet, and once at the end
+    template<typename F>
+    void epoch(const batch_source &source, int mode, F progress) {
+        size_t batches = source.batches();
+        if (halted) {
+            return;
+        }
+        mode = effective_train_mode(mode, tr.precision());
+        if (mode == TRAIN_HOGWILD) {
+            int tasks = pool.size();
+            std::vector<std::atomic<size_t>> next(tasks);
+            for (int k = 0; k < tasks; ++k) {
+                next[k] = k;
+            }
+            pool.run(tasks, [&](int k) {
+                batch b;
+                for (size_t q = k; q < batches && !halted; q += tasks) {
+                    source.fill(q, b);
+                    if (source.isSparse()) {
+                        tr.trainLockFree(b.sparse, b.targets, *ws[k]);
+                    } else {
+                        tr.trainLockFree(b.inputs, b.targets, *ws[k]);
+                    }
+                    next[k] = q + tasks;
+                    if (k == 0) {
+                        size_t done = batches;
+                        for (auto &n : next) {
+                            size_t v = n;
+                            done = v < done ? v : done;
+                        }
+                        size_t trained = source.skipped() + done * source.batchSize();
+                        progress(trained < source.records() ? trained : source.records());
+                    }
+                }
+            });
+            progress(source.records());
+            return;
+        }
+        size_t trained = source.skipped();
+        auto step = [&](batch &b) {
+            trained += b.targets.rows();
+            if (mode == TRAIN_SYNC && source.isSparse()) {
+                trainSync(b.sparse, b.targets);
+            } else if (mode == TRAIN_SYNC) {
+                trainSync(b.inputs, b.targets);
+            } else if (source.isSparse()) {
+                tr.train(b.sparse, b.targets);
+            } else {
+                tr.train(b.inputs, b.targets);
+            }
+            progress(trained);
+        };
+        if (prefetch > 0) {
+            prefetcher pf(source, prefetch);
+            while (batch *b = pf.next()) {
+                step(*b);
+                if (halted) {
+                    break;
+                }
+            }
+            waited += pf.waitSeconds();
+            stalled += pf.stallSeconds();
+            return;
+        }
+        batch b;
+        for (size_t q = 0; q < batches && !halted; ++q) {
+            auto bt = std::chrono::steady_clock::now();
+            source.fill(q, b);
+            waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+            step(b);
+        }
+    }
+
+    // stop training after the batches being trained, from progress or any
+    // other thread. epochs started later return at once
+    void interrupt() {
+        halted = true;
+    }
+
+    bool interrupted() const {
+        return halted;
+    }
+
+    // stage batches on a background thread into a ring of depth buffers,
+    // 0 stages them inline. not used in hogwild mode
+    void setPrefetch(int depth) {
+        prefetch = depth;
+    }
+
+    // seconds the training thread spent waiting for batches to be staged
+    double waitSeconds() const {
+        return waited;
+    }
+
+    // seconds the prefetch thread spent waiting for a free buffer
+    double stallSeconds() const {
+        return stalled;
+    }
+
+protected:
+    // sum the shard gradients into ws[0], one slice of them per thread,
+    // then apply them
+    void reduce(int shards) {
+        PROFILE_TIMER(pt);
+        PROFILE_NEXT(pt, PROF_REDUCE, 0);
+        pool.run(pool.size(), [&](int k) {
+            for (int i = 1; i < shards; ++i) {
+                ws[0]->accumulate(*ws[i], k, pool.size());
+            }
+        });
+        PROFILE_STOP(pt);
+        tr.update(*ws[0]);
+    }
+
+    T &tr;
+    thread_pool pool;
+    std::vector<workspace *> ws;
+    int prefetch;
+    std::atomic<bool> halted;
+    double waited;
+    double stalled;
+};
+
+// whether the sparse first layer trains faster than the dense one, timed
+// on a clone of tr over the first batches of data. which one wins depends
+// on the pixel density, the batch size, the hidden units and the isa, so
+// it is measured instead of guessed. staging a batch is timed with its
+// step, the sparse rows cost more to build and the prefetch thread only
+// hides that when a core is free for it. the kernels take turns for a few
+// rounds and the best round of each counts, a noisy moment costs both
+template<typename T>
+bool sparse_is_faster(const T &tr, const dataset &data, int size)
+{
+    enum { STEPS = 8, ROUNDS = 3 };
+    if (!T::SPARSE_KERNELS || data.size() < size_t(size)) {
+        return false;
+    }
+    std::unique_ptr<T> p(tr.clone());
+    batch_source source(data, size);
+    size_t steps = source.batches() < size_t(STEPS) ? source.batches() : size_t(STEPS);
+    batch b;
+    double best[2] = { 0, 0 };
+    for (int r = 0; r <= ROUNDS; ++r) {
+        for (int k = 0; k < 2; ++k) {
+            source.setSparse(k == 1);
+            auto bt = std::chrono::steady_clock::now();
+            for (size_t q = 0; q < steps; ++q) {
+                source.fill(q, b);
+                if (k == 1) {
+                    p->train(b.sparse, b.targets);
+                } else {
+                    p->train(b.inputs, b.targets);
+                }
+            }
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - bt).count();
+            // round 0 warms up the workspaces and the caches
+            if (r == 1 || (r > 1 && secs < best[k])) {
+                best[k] = secs;
+            }
+        }
+    }
+    return best[1] < best[0];
+}
+
+#endif
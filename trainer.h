@@ -18,11 +18,26 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
+#ifndef MNIST_TRAINER_H
+#define MNIST_TRAINER_H
+
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <Eigen/Dense>
+#include "kernels.h"
+#include "half.h"
+#include "sparse.h"
+#include "profile.h"
 
 using namespace Eigen;
 
@@ -41,103 +56,536 @@ protected:
     T &o;
 };
 
+// on-disk layout of a binary model:
+//   [header, 64 bytes][wih, input * hidden floats][pad][who, hidden * output floats]
+// both matrices are stored like in memory, wih row major and who column
+// major (version 1 had wih column major too), each starts on a 64 byte
+// boundary, the checksum covers the bytes of wih then who. a half model
+// stores every weight in the 2 bytes of its dtype instead of a float. a
+// checkpoint also records where training was: the shuffle seed of its
+// epoch and the records of that epoch already trained, both 0 in a saved
+// model
+struct model_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t input;
+    uint32_t hidden;
+    uint32_t output;
+    uint32_t epoch;
+    uint64_t ih;
+    uint64_t ho;
+    uint64_t checksum;
+    uint64_t trained;
+};
+
+// the same values as enum precision
+enum model_dtype
+{
+    MODEL_F32 = PREC_FP32,
+    MODEL_BF16 = PREC_BF16,
+    MODEL_F16 = PREC_FP16
+};
+
+inline size_t model_dtype_size(uint32_t dtype)
+{
+    return dtype == MODEL_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+// the bytes of n weights stored as dtype: p itself for floats, else the
+// weights converted into buf
+inline const char *model_bytes(const float *p, size_t n, uint32_t dtype, std::vector<uint16_t> &buf)
+{
+    if (dtype == MODEL_F32) {
+        return reinterpret_cast<const char *>(p);
+    }
+    buf.resize(n);
+    to_half(p, buf.data(), n, dtype);
+    return reinterpret_cast<const char *>(buf.data());
+}
+
+// read n weights stored as dtype at b into p
+inline void model_weights(const char *b, float *p, size_t n, uint32_t dtype)
+{
+    if (dtype == MODEL_F32) {
+        memcpy(p, b, sizeof(float) * n);
+        return;
+    }
+    std::vector<uint16_t> buf(n);
+    memcpy(buf.data(), b, sizeof(uint16_t) * n);
+    from_half(buf.data(), p, n, dtype);
+}
+
+// fnv-1a over 64 bit words, then over the tail bytes. pass the result
+// of a previous call as h to continue over another range
+inline uint64_t model_checksum(const void *p, size_t n, uint64_t h = 14695981039346656037ULL)
+{
+    const unsigned char *b = static_cast<const unsigned char *>(p);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, b + i, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i < n; ++i) {
+        h = (h ^ b[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// binary models are recognized by their magic, whatever the extension
+inline bool is_binary_model(const char *path)
+{
+    char magic[8] = {0};
+    std::ifstream is(path, std::ios::in | std::ios::binary);
+    if (!is.is_open() || !is.read(magic, sizeof(magic))) {
+        return false;
+    }
+    return memcmp(magic, "MNISTMD", 8) == 0;
+}
+
+// where training was when the checkpoint at path was written
+inline int model_position(const char *path, uint32_t &epoch, uint64_t &trained)
+{
+    model_header h;
+    std::ifstream is(path, std::ios::in | std::ios::binary);
+    if (!is.is_open() || !is.read(reinterpret_cast<char *>(&h), sizeof(h)) || memcmp(h.magic, "MNISTMD", 8) != 0) {
+        return -1;
+    }
+    epoch = h.epoch;
+    trained = h.trained;
+    return 0;
+}
+
+// one row of weights of a text model
+inline std::vector<float> parse_weights(const std::string &s)
+{
+    std::vector<float> v;
+    std::string elem;
+    const char *b = s.c_str(), *c = b, *e = b + s.length();
+    while (c <= e) {
+        if (c == e || *c == ',') {
+            elem.assign(b, c - b);
+            v.push_back(stof(elem));
+            b = c + 1;
+        }
+        ++c;
+    }
+    return v;
+}
+
+// the "rows,cols" line in front of a matrix of a text model
+inline int parse_dim(const std::string &s, int &rows, int &cols)
+{
+    int ret = -1;
+    std::string str;
+    const char *b = s.c_str(), *c = b, *e = b + s.length();
+    while (c <= e) {
+        if (*c == ',') {
+            str.assign(b, c - b);
+            rows = stoi(str);
+            str.assign(c + 1, e - c - 1);
+            cols = stoi(str);
+            ret = 0;
+            break;
+        }
+        ++c;
+    }
+    return ret;
+}
+
+// n weights uniform in [-1, 1] drawn from rng, what Random() gives but
+// repeatable and without the shared state of rand()
+inline void random_weights(float *p, size_t n, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> u(-1.0f, 1.0f);
+    for (size_t i = 0; i < n; ++i) {
+        p[i] = u(rng);
+    }
+}
+
+// rows of half weights the half products widen at a time, a panel of 64
+// rows of 225 floats is 57KB and stays in the l2 cache
+enum { HALF_PANEL = 64 };
+
+// out = x * w, or out += x * w when add, for w the k x n row major matrix
+// of half values at h, k being x.cols(). the rows of w are widened
+// HALF_PANEL at a time into panel, HALF_PANEL * n floats, and multiplied
+// in from there, so the weights are read in 16 bits and only one panel of
+// them is ever in floats. N is n when it is fixed
+template<int N, typename D, typename O>
+void half_product(const MatrixBase<D> &x, const uint16_t *h, int n, int prec, float *panel, const MatrixBase<O> &dst, bool add = false)
+{
+    MatrixBase<O> &out = const_cast<MatrixBase<O> &>(dst);
+    int k = x.cols();
+    for (int r = 0; r < k; r += HALF_PANEL) {
+        int m = k - r < HALF_PANEL ? k - r : HALF_PANEL;
+        from_half(h + size_t(r) * n, panel, size_t(m) * n, prec);
+        Map<const Matrix<float, Dynamic, N, RowMajor, HALF_PANEL, N>> w(panel, m, n);
+        if (r == 0 && !add) {
+            out.noalias() = x.middleCols(r, m) * w;
+        } else {
+            out.noalias() += x.middleCols(r, m) * w;
+        }
+    }
+}
+
+// out = x * w^T for the same w, x having n columns. a panel of rows of w
+// gives a block of columns of out
+template<int N, typename D, typename O>
+void half_product_transposed(const MatrixBase<D> &x, const uint16_t *h, int k, int prec, float *panel, const MatrixBase<O> &dst)
+{
+    MatrixBase<O> &out = const_cast<MatrixBase<O> &>(dst);
+    int n = x.cols();
+    for (int r = 0; r < k; r += HALF_PANEL) {
+        int m = k - r < HALF_PANEL ? k - r : HALF_PANEL;
+        from_half(h + size_t(r) * n, panel, size_t(m) * n, prec);
+        Map<const Matrix<float, Dynamic, N, RowMajor, HALF_PANEL, N>> w(panel, m, n);
+        out.middleCols(r, m).noalias() = x * w.transpose();
+    }
+}
+
+// models are saved in binary when the path ends with .bin
+inline bool is_binary_model_path(const char *path)
+{
+    size_t n = strlen(path);
+    return n >= 4 && strcmp(path + n - 4, ".bin") == 0;
+}
+
 template<int INPUT, int HIDDEN, int OUTPUT>
 class trainer
 {
 public:
-    trainer(float lrate) : lrate(lrate), ph1(nullptr), po1(nullptr) {
-        pwih = new Matrix<float, INPUT, HIDDEN>();
+    // rows of the per step buffers. a larger batch is processed in chunks
+    // of this many rows and the chunk gradients are summed before the
+    // update. the fixed upper bound also lets eigen keep the gemm packing
+    // buffers on the stack, so a step makes no heap allocation at all
+    enum { CHUNK = 128, SPARSE_KERNELS = 1 };
+    
+    struct workspace
+    {
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+        
+        Matrix<float, Dynamic, HIDDEN, RowMajor, CHUNK, HIDDEN> houtputs;
+        Matrix<float, Dynamic, HIDDEN, RowMajor, CHUNK, HIDDEN> herrors;
+        Matrix<float, Dynamic, OUTPUT, 0, CHUNK, OUTPUT> outputs;
+        Matrix<float, Dynamic, OUTPUT, 0, CHUNK, OUTPUT> oerrors;
+        Matrix<float, INPUT, HIDDEN, RowMajor> gih;
+        Matrix<float, HIDDEN, OUTPUT> gho;
+        // sparse steps only: gbias is the rank one part of gih which update()
+        // adds to every row, wbias the PIXEL_BIAS part of the first layer
+        Matrix<float, 1, HIDDEN> gbias;
+        Matrix<float, 1, HIDDEN> wbias;
+        // half precisions only: a panel of the first layer weights and the
+        // second layer weights, widened from their 16 bit storage
+        Matrix<float, HALF_PANEL, HIDDEN, RowMajor> panel;
+        Matrix<float, HIDDEN, OUTPUT> who;
+        // the nonzero pixels of a chunk by pixel
+        sparse_rows columns;
+        bool sparse;
+        
+        // add slice part of parts of the gradients in o to these, the
+        // slices together cover all of them, so they can be summed in
+        // parallel
+        void accumulate(const workspace &o, int part, int parts) {
+            int b = INPUT * part / parts, e = INPUT * (part + 1) / parts;
+            gih.middleRows(b, e - b) += o.gih.middleRows(b, e - b);
+            if (part == 0) {
+                gho += o.gho;
+                if (sparse) {
+                    gbias += o.gbias;
+                }
+            }
+        }
+    };
+    
+    trainer(float lrate) : lrate(lrate), act(ACT_SIMD), prec(PREC_FP32) {
+        pwih = new Matrix<float, INPUT, HIDDEN, RowMajor>();
         pwho = new Matrix<float, HIDDEN, OUTPUT>();
-        *pwih = Matrix<float, INPUT, HIDDEN>::Random();
+        *pwih = Matrix<float, INPUT, HIDDEN, RowMajor>::Random();
         *pwho = Matrix<float, HIDDEN, OUTPUT>::Random();
+        pws = new workspace();
     }
     
     ~trainer() {
+        delete pws;
         delete pwho;
         delete pwih;
-        if (ph1) {
-            delete ph1;
+    }
+    
+    // start over from weights drawn from seed
+    void randomize(unsigned seed) {
+        std::mt19937 rng(seed);
+        random_weights(pwih->data(), pwih->size(), rng);
+        random_weights(pwho->data(), pwho->size(), rng);
+        refresh();
+    }
+    
+    // a new trainer with the same rate, kernel and weights
+    trainer *clone() const {
+        trainer *p = new trainer(lrate);
+        p->act = act;
+        *p->pwih = *pwih;
+        *p->pwho = *pwho;
+        p->setPrecision(prec);
+        return p;
+    }
+    
+    // apply the activation in place, x may be a block of a larger matrix
+    template<typename Derived>
+    static void sigmoid(const MatrixBase<Derived> &x) {
+        MatrixBase<Derived> &m = const_cast<MatrixBase<Derived> &>(x);
+        m.array() = (1.0f + (-m.array()).exp()).inverse();
+    }
+    
+    void setActivation(int mode) {
+        act = mode;
+    }
+    
+    int activation() const {
+        return act;
+    }
+    
+    // the step is rate times the gradient summed over the batch
+    void setRate(float rate) {
+        lrate = rate;
+    }
+    
+    float rate() const {
+        return lrate;
+    }
+    
+    // in the half precisions pwih and pwho are the master weights the
+    // updates go to, hih and hho their 16 bit copies the products read
+    void setPrecision(int mode) {
+        prec = mode;
+        if (prec == PREC_FP32) {
+            std::vector<uint16_t>().swap(hih);
+            std::vector<uint16_t>().swap(hho);
+            return;
+        }
+        hih.resize(INPUT * HIDDEN + HALF_PAD);
+        hho.resize(HIDDEN * OUTPUT);
+        refresh();
+    }
+    
+    int precision() const {
+        return prec;
+    }
+    
+    // sigmoid in place with the selected kernel, rounded to the precision
+    template<typename Derived>
+    void activate(PlainObjectBase<Derived> &m) const {
+        if (act == ACT_SIMD) {
+            sigmoid_simd(m.data(), m.size());
+        } else if (act == ACT_FAST) {
+            sigmoid_fast(m.data(), m.size());
+        } else {
+            sigmoid(m);
         }
-        if (po1) {
-            delete po1;
+        if (prec != PREC_FP32) {
+            round_half(m.data(), m.size(), prec);
         }
     }
     
-    Matrix<float, Dynamic, HIDDEN> sigmoid(Matrix<float, Dynamic, HIDDEN> hinputs) {
-        int rows = hinputs.rows();
-        if (!ph1) {
-            ph1 = new Array<float, Dynamic, HIDDEN>(rows, HIDDEN);
-            ph1->fill(1.0f);
-        } else if (ph1->rows() != rows) {
-            delete ph1;
-            ph1 = new Array<float, Dynamic, HIDDEN>(rows, HIDDEN);
-            ph1->fill(1.0f);
+    // errors *= outputs * (1 - outputs), outputs being sigmoid results
+    template<typename D1, typename D2>
+    void derive(PlainObjectBase<D1> &errors, const PlainObjectBase<D2> &outputs) const {
+        if (act == ACT_EIGEN) {
+            errors.array() *= outputs.array() * (1.0f - outputs.array());
+        } else {
+            sigmoid_grad_mul(errors.data(), outputs.data(), errors.size());
         }
-        return *ph1 / (*ph1 + (-hinputs.array()).exp());
     }
     
-    Matrix<float, Dynamic, OUTPUT> sigmoid(Matrix<float, Dynamic, OUTPUT> oinputs) {
-        int rows = oinputs.rows();
-        if (!po1) {
-            po1 = new Array<float, Dynamic, OUTPUT>(rows, OUTPUT);
-            po1->fill(1.0f);
-        } else if (po1->rows() != rows) {
-            delete po1;
-            po1 = new Array<float, Dynamic, OUTPUT>(rows, OUTPUT);
-            po1->fill(1.0f);
+    template<typename D1, typename D2>
+    void train(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets) {
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        internal::set_is_malloc_allowed(false);
+#endif
+        gradient(inputs, targets, *pws);
+        update(*pws);
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        internal::set_is_malloc_allowed(true);
+#endif
+    }
+    
+    template<typename D>
+    void train(const sparse_rows &inputs, const MatrixBase<D> &targets) {
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        internal::set_is_malloc_allowed(false);
+#endif
+        gradient(inputs, 0, targets, *pws);
+        update(*pws);
+#ifdef EIGEN_RUNTIME_NO_MALLOC
+        internal::set_is_malloc_allowed(true);
+#endif
+    }
+    
+    // the weight changes of one batch against the current weights, before
+    // scaling by the learning rate, are left in ws.gih and ws.gho. only ws
+    // is written, so threads with their own workspaces can compute
+    // gradients of different shards at the same time
+    template<typename D1, typename D2>
+    void gradient(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets, workspace &ws) const {
+        int rows = inputs.rows();
+        ws.sparse = false;
+        PROFILE_TIMER(pt);
+        const Matrix<float, HIDDEN, OUTPUT> &who = ho(ws.who);
+        for (int b = 0; b < rows || b == 0; b += CHUNK) {
+            int n = rows - b < CHUNK ? rows - b : CHUNK;
+            PROFILE_NEXT(pt, PROF_FORWARD, n);
+            ws.houtputs.resize(n, HIDDEN);
+            forward(inputs.middleRows(b, n), ws.houtputs, ws.panel.data());
+            PROFILE_NEXT(pt, PROF_SIGMOID, n);
+            activate(ws.houtputs);
+            PROFILE_NEXT(pt, PROF_FORWARD, 0);
+            ws.outputs.resize(n, OUTPUT);
+            ws.outputs.noalias() = ws.houtputs * who;
+            PROFILE_NEXT(pt, PROF_SIGMOID, 0);
+            activate(ws.outputs);
+            
+            PROFILE_NEXT(pt, PROF_BACKWARD, n);
+            ws.oerrors = targets.middleRows(b, n) - ws.outputs;
+            ws.herrors.resize(n, HIDDEN);
+            ws.herrors.noalias() = ws.oerrors * who.transpose();
+            derive(ws.herrors, ws.houtputs);
+            derive(ws.oerrors, ws.outputs);
+            
+            if (b == 0) {
+                ws.gho.noalias() = ws.houtputs.transpose() * ws.oerrors;
+                ws.gih.noalias() = inputs.middleRows(b, n).transpose() * ws.herrors;
+            } else {
+                ws.gho.noalias() += ws.houtputs.transpose() * ws.oerrors;
+                ws.gih.noalias() += inputs.middleRows(b, n).transpose() * ws.herrors;
+            }
         }
-        return *po1 / (*po1 + (-oinputs.array()).exp());
     }
     
-    void train(Matrix<float, Dynamic, INPUT> &inputs, Matrix<float, Dynamic, OUTPUT> &targets) {
-        Matrix<float, Dynamic, HIDDEN> hinputs = inputs * *pwih;
-        Matrix<float, Dynamic, HIDDEN> houtputs = sigmoid(hinputs);
-        Matrix<float, Dynamic, OUTPUT> oinputs = houtputs * *pwho;
-        Matrix<float, Dynamic, OUTPUT> outputs = sigmoid(oinputs);
-        
-        Matrix<float, Dynamic, OUTPUT> oerrors = targets.array() - outputs.array();
-        Matrix<float, Dynamic, HIDDEN> herrors = oerrors * pwho->transpose();
-        
-        int orows = outputs.rows();
-        if (!po1) {
-            po1 = new Array<float, Dynamic, OUTPUT>(orows, OUTPUT);
-            po1->fill(1.0f);
-        } else if (po1->rows() != orows) {
-            delete po1;
-            po1 = new Array<float, Dynamic, OUTPUT>(orows, OUTPUT);
-            po1->fill(1.0f);
-        }
-        pwho->array() += (houtputs.transpose() * (oerrors.array() * outputs.array() * (*po1 - outputs.array())).matrix()).array() * lrate;
-        
-        int hrows = hinputs.rows();
-        if (!ph1) {
-            ph1 = new Array<float, Dynamic, HIDDEN>(hrows, HIDDEN);
-            ph1->fill(1.0f);
-        } else if (ph1->rows() != hrows) {
-            delete ph1;
-            ph1 = new Array<float, Dynamic, HIDDEN>(hrows, HIDDEN);
-            ph1->fill(1.0f);
+    // the same for the rows [first, first + targets.rows()) of a sparse
+    // batch. with x = v + PIXEL_BIAS, v being the stored values,
+    //   x * wih = v * wih + PIXEL_BIAS * colsum(wih)
+    //   x^T * herrors = v^T * herrors + PIXEL_BIAS * 1 * colsum(herrors)
+    // so only the rows of wih and gih at nonzero pixels are visited, and
+    // the second term of the gradient is left in ws.gbias
+    template<typename D>
+    void gradient(const sparse_rows &inputs, int first, const MatrixBase<D> &targets, workspace &ws) const {
+        int rows = targets.rows();
+        ws.sparse = true;
+        PROFILE_TIMER(pt);
+        PROFILE_NEXT(pt, PROF_FORWARD, 0);
+        const Matrix<float, HIDDEN, OUTPUT> &who = ho(ws.who);
+        forward(Matrix<float, 1, INPUT>::Constant(PIXEL_BIAS), ws.wbias, ws.panel.data());
+        ws.gbias.setZero();
+        for (int b = 0; b < rows || b == 0; b += CHUNK) {
+            int n = rows - b < CHUNK ? rows - b : CHUNK;
+            const uint32_t *start = inputs.start.data() + first + b;
+            PROFILE_NEXT(pt, PROF_FORWARD, n);
+            ws.houtputs.resize(n, HIDDEN);
+            for (int i = 0; i < n; ++i) {
+                ws.houtputs.row(i) = ws.wbias;
+                combine(inputs.index.data() + start[i], inputs.value.data() + start[i], start[i + 1] - start[i], ws.houtputs.row(i).data());
+            }
+            PROFILE_NEXT(pt, PROF_SIGMOID, n);
+            activate(ws.houtputs);
+            PROFILE_NEXT(pt, PROF_FORWARD, 0);
+            ws.outputs.resize(n, OUTPUT);
+            ws.outputs.noalias() = ws.houtputs * who;
+            PROFILE_NEXT(pt, PROF_SIGMOID, 0);
+            activate(ws.outputs);
+            
+            PROFILE_NEXT(pt, PROF_BACKWARD, n);
+            ws.oerrors = targets.middleRows(b, n) - ws.outputs;
+            ws.herrors.resize(n, HIDDEN);
+            ws.herrors.noalias() = ws.oerrors * who.transpose();
+            derive(ws.herrors, ws.houtputs);
+            derive(ws.oerrors, ws.outputs);
+            
+            if (b == 0) {
+                ws.gho.noalias() = ws.houtputs.transpose() * ws.oerrors;
+            } else {
+                ws.gho.noalias() += ws.houtputs.transpose() * ws.oerrors;
+            }
+            // every row of gih sums the herrors rows of the records which
+            // have that pixel set, rows without any are zeroed
+            inputs.transpose(first + b, n, INPUT, ws.columns);
+            const uint32_t *cstart = ws.columns.start.data();
+            for (int k = 0; k < INPUT; ++k) {
+                const uint16_t *ci = ws.columns.index.data() + cstart[k];
+                const float *cv = ws.columns.value.data() + cstart[k];
+                if (b == 0) {
+                    sparse_combine<HIDDEN, false>(ci, cv, cstart[k + 1] - cstart[k], ws.herrors.data(), ws.gih.row(k).data());
+                } else {
+                    sparse_combine<HIDDEN, true>(ci, cv, cstart[k + 1] - cstart[k], ws.herrors.data(), ws.gih.row(k).data());
+                }
+            }
+            ws.gbias.noalias() += ws.herrors.colwise().sum();
+        }
+        ws.gbias *= PIXEL_BIAS;
+    }
+    
+    void update(const workspace &ws) {
+        PROFILE_SCOPE(PROF_UPDATE, 0);
+        pwho->noalias() += ws.gho * lrate;
+        if (ws.sparse) {
+            pwih->noalias() += (ws.gih.rowwise() + ws.gbias) * lrate;
+        } else {
+            pwih->noalias() += ws.gih * lrate;
         }
-        pwih->array() += (inputs.transpose() * (herrors.array() * houtputs.array() * (*ph1 - houtputs.array())).matrix()).array() * lrate;
+        refresh();
+    }
+    
+    // hogwild step: the gradient is added into the shared weights without
+    // any locking, other threads may be reading or updating them meanwhile
+    template<typename D1, typename D2>
+    void trainLockFree(const MatrixBase<D1> &inputs, const MatrixBase<D2> &targets, workspace &ws) {
+        gradient(inputs, targets, ws);
+        update(ws);
+    }
+    
+    template<typename D>
+    void trainLockFree(const sparse_rows &inputs, const MatrixBase<D> &targets, workspace &ws) {
+        gradient(inputs, 0, targets, ws);
+        update(ws);
     }
     
     Matrix<float, Dynamic, OUTPUT> predict(Matrix<float, Dynamic, INPUT> &inputs) {
-        Matrix<float, Dynamic, HIDDEN> hinputs = inputs * *pwih;
-        Matrix<float, Dynamic, HIDDEN> houtputs = sigmoid(hinputs);
-        Matrix<float, Dynamic, OUTPUT> oinputs = houtputs * *pwho;
-        Matrix<float, Dynamic, OUTPUT> outputs = sigmoid(oinputs);
+        Matrix<float, Dynamic, OUTPUT> outputs;
+        predict(inputs, outputs);
         return outputs;
     }
     
-    Matrix<float, INPUT, HIDDEN> getIh() {
+    // const version for scoring from several threads at once, inputs may
+    // be row or column major
+    template<typename Derived>
+    void predict(const MatrixBase<Derived> &inputs, Matrix<float, Dynamic, OUTPUT> &outputs) const {
+        PROFILE_SCOPE(PROF_PREDICT, inputs.rows());
+        Matrix<float, Dynamic, HIDDEN> houtputs(inputs.rows(), HIDDEN);
+        std::vector<float> panel(prec == PREC_FP32 ? 0 : HALF_PANEL * HIDDEN);
+        Matrix<float, HIDDEN, OUTPUT> who;
+        forward(inputs, houtputs, panel.data());
+        activate(houtputs);
+        outputs.noalias() = houtputs * ho(who);
+        activate(outputs);
+    }
+    
+    const Matrix<float, INPUT, HIDDEN, RowMajor> &getIh() const {
         return *pwih;
     }
     
-    Matrix<float, HIDDEN, OUTPUT> getHo() {
+    const Matrix<float, HIDDEN, OUTPUT> &getHo() const {
         return *pwho;
     }
     
-    int saveModel(const char *path) {
+    enum { MODEL_VERSION = 2, MODEL_ALIGN = 64 };
+    
+    // a path ending with .bin is saved in the binary format, with the
+    // weights stored as dtype, anything else as csv text
+    int saveModel(const char *path, int dtype = MODEL_F32) {
+        if (is_binary_model_path(path)) {
+            return saveBinary(path, dtype);
+        }
         std::ofstream os(path, std::ios::out);
         if (!os.is_open()) {
             std::cout << "cannot open: " << path << std::endl;
@@ -171,7 +619,11 @@ public:
         return 0;
     }
     
+    // binary models are recognized by their magic, whatever the extension
     int loadModel(const char *path) {
+        if (is_binary_model(path)) {
+            return loadBinary(path);
+        }
         std::ifstream is(path, std::ios::in);
         if (!is.is_open()) {
             std::cout << "cannot open: " << path << std::endl;
@@ -187,8 +639,8 @@ public:
         }
         int i = 0;
         while (i < rows && std::getline(is, line)) {
-            std::vector<float> rd = parse_row(line);
-            if (rd.size() != cols) {
+            std::vector<float> rd = parse_weights(line);
+            if (rd.size() != size_t(cols)) {
                 return -1;
             }
             for (int j = 0; j < cols; ++j) {
@@ -206,8 +658,8 @@ public:
         }
         i = 0;
         while (i < rows && std::getline(is, line)) {
-            std::vector<float> rd = parse_row(line);
-            if (rd.size() != cols) {
+            std::vector<float> rd = parse_weights(line);
+            if (rd.size() != size_t(cols)) {
                 return -1;
             }
             for (int j = 0; j < cols; ++j) {
@@ -218,48 +670,195 @@ public:
         if (i != rows) {
             return -1;
         }
+        refresh();
         return 0;
     }
     
-protected:
-    std::vector<float> parse_row(const std::string &s) {
-        std::vector<float> v;
-        std::string elem;
-        const char *b = s.c_str(), *c = b, *e = b + s.length();
-        while (c <= e) {
-            if (c == e || *c == ',') {
-                elem.assign(b, c - b);
-                v.push_back(stof(elem));
-                b = c + 1;
-            }
-            ++c;
+    // write to path.tmp then rename, a reader never sees a partial model
+    int saveBinary(const char *path, int dtype = MODEL_F32) const {
+        return writeBinary(path, pwih->data(), pwho->data(), 0, 0, dtype);
+    }
+    
+    std::vector<int> layers() const {
+        return std::vector<int>{INPUT, HIDDEN, OUTPUT};
+    }
+    
+    // number of weights
+    size_t parameters() const {
+        return INPUT * HIDDEN + HIDDEN * OUTPUT;
+    }
+    
+    // copy the weights out to p, parameters() floats, for writing them
+    // later with writeSnapshot
+    void snapshot(float *p) const {
+        memcpy(p, pwih->data(), sizeof(float) * INPUT * HIDDEN);
+        memcpy(p + INPUT * HIDDEN, pwho->data(), sizeof(float) * HIDDEN * OUTPUT);
+    }
+    
+    // put back weights copied out by snapshot
+    void restore(const float *p) {
+        memcpy(pwih->data(), p, sizeof(float) * INPUT * HIDDEN);
+        memcpy(pwho->data(), p + INPUT * HIDDEN, sizeof(float) * HIDDEN * OUTPUT);
+        refresh();
+    }
+    
+    int writeSnapshot(const char *path, const float *p, uint32_t epoch, uint64_t trained) const {
+        return writeBinary(path, p, p + INPUT * HIDDEN, epoch, trained);
+    }
+    
+    // write weights laid out like pwih and pwho as a binary model, into a
+    // temporary file renamed over path, so path is never half written
+    static int writeBinary(const char *path, const float *ih, const float *ho, uint32_t epoch = 0, uint64_t trained = 0, int dtype = MODEL_F32) {
+        model_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "MNISTMD", 8);
+        h.version = MODEL_VERSION;
+        h.dtype = dtype;
+        h.input = INPUT;
+        h.hidden = HIDDEN;
+        h.output = OUTPUT;
+        h.epoch = epoch;
+        h.trained = trained;
+        size_t bih = model_dtype_size(dtype) * INPUT * HIDDEN, bho = model_dtype_size(dtype) * HIDDEN * OUTPUT;
+        h.ih = sizeof(model_header);
+        h.ho = (h.ih + bih + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+        std::vector<uint16_t> hih, hho;
+        const char *sih = model_bytes(ih, INPUT * HIDDEN, dtype, hih), *sho = model_bytes(ho, HIDDEN * OUTPUT, dtype, hho);
+        h.checksum = model_checksum(sho, bho, model_checksum(sih, bih));
+        std::string tmp = std::string(path) + ".tmp";
+        std::ofstream os(tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!os.is_open()) {
+            std::cout << "cannot open: " << tmp << std::endl;
+            return -1;
+        }
+        os.write(reinterpret_cast<const char *>(&h), sizeof(h));
+        os.write(sih, bih);
+        char pad[MODEL_ALIGN] = {0};
+        os.write(pad, h.ho - h.ih - bih);
+        os.write(sho, bho);
+        os.close();
+        if (!os || rename(tmp.c_str(), path) < 0) {
+            unlink(tmp.c_str());
+            return -1;
         }
-        return v;
+        return 0;
     }
     
-    int parse_dim(const std::string &s, int &rows, int &cols) {
+    // map the file, check it and copy both matrices in one go each
+    int loadBinary(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            std::cout << "cannot open: " << path << std::endl;
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(model_header)) {
+            close(fd);
+            return -1;
+        }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return -1;
+        }
+        const model_header *h = static_cast<const model_header *>(p);
+        const char *base = static_cast<const char *>(p);
+        size_t bih = model_dtype_size(h->dtype) * INPUT * HIDDEN, bho = model_dtype_size(h->dtype) * HIDDEN * OUTPUT;
         int ret = -1;
-        std::string str;
-        const char *b = s.c_str(), *c = b, *e = b + s.length();
-        while (c <= e) {
-            if (*c == ',') {
-                str.assign(b, c - b);
-                rows = stoi(str);
-                str.assign(c + 1, e - c - 1);
-                cols = stoi(str);
+        if (validHeader(*h, st.st_size)) {
+            if (model_checksum(base + h->ho, bho, model_checksum(base + h->ih, bih)) != h->checksum) {
+                std::cout << "checksum mismatch: " << path << std::endl;
+            } else {
+                if (h->version == 1) {
+                    *pwih = Map<const Matrix<float, INPUT, HIDDEN>>(reinterpret_cast<const float *>(base + h->ih));
+                } else {
+                    model_weights(base + h->ih, pwih->data(), INPUT * HIDDEN, h->dtype);
+                }
+                model_weights(base + h->ho, pwho->data(), HIDDEN * OUTPUT, h->dtype);
+                refresh();
                 ret = 0;
-                break;
             }
-            ++c;
         }
+        munmap(p, st.st_size);
         return ret;
     }
     
+protected:
+    static bool validHeader(const model_header &h, size_t length) {
+        if (memcmp(h.magic, "MNISTMD", 8) != 0 || (h.version != 1 && h.version != MODEL_VERSION) || h.dtype > MODEL_F16) {
+            return false;
+        }
+        if (h.version == 1 && h.dtype != MODEL_F32) {
+            return false;
+        }
+        if (h.input != INPUT || h.hidden != HIDDEN || h.output != OUTPUT) {
+            std::cout << "model is " << h.input << "x" << h.hidden << "x" << h.output << std::endl;
+            return false;
+        }
+        if (h.ih < sizeof(model_header) || h.ih % MODEL_ALIGN != 0 || h.ho % MODEL_ALIGN != 0) {
+            return false;
+        }
+        if (h.ih + model_dtype_size(h.dtype) * INPUT * HIDDEN > h.ho) {
+            return false;
+        }
+        return h.ho + model_dtype_size(h.dtype) * HIDDEN * OUTPUT <= length;
+    }
+    
+    // out = x * wih, in a half precision from the 16 bit weights, widened
+    // a panel at a time into panel, HALF_PANEL * HIDDEN floats
+    template<typename D, typename O>
+    void forward(const MatrixBase<D> &x, const MatrixBase<O> &out, float *panel) const {
+        if (prec == PREC_FP32) {
+            const_cast<MatrixBase<O> &>(out).noalias() = x * *pwih;
+        } else {
+            half_product<HIDDEN>(x, hih.data(), HIDDEN, prec, panel, out);
+        }
+    }
+    
+    // the second layer weights the products use: pwho, or in a half
+    // precision hho widened into who, it is small enough to widen whole
+    const Matrix<float, HIDDEN, OUTPUT> &ho(Matrix<float, HIDDEN, OUTPUT> &who) const {
+        if (prec == PREC_FP32) {
+            return *pwho;
+        }
+        from_half(hho.data(), who.data(), who.size(), prec);
+        return who;
+    }
+    
+    // y += the rows of wih at index scaled by value, read in the precision
+    template<typename I>
+    void combine(const I *index, const float *value, int count, float *y) const {
+        if (prec == PREC_BF16) {
+            sparse_combine<HIDDEN, true, PREC_BF16>(index, value, count, hih.data(), y);
+        } else if (prec == PREC_FP16) {
+            sparse_combine<HIDDEN, true, PREC_FP16>(index, value, count, hih.data(), y);
+        } else {
+            sparse_combine<HIDDEN, true>(index, value, count, pwih->data(), y);
+        }
+    }
+    
+    // convert the master weights into the 16 bit copies of the half
+    // precisions, once per update
+    void refresh() {
+        if (prec == PREC_FP32) {
+            return;
+        }
+        to_half(pwih->data(), hih.data(), INPUT * HIDDEN, prec);
+        to_half(pwho->data(), hho.data(), HIDDEN * OUTPUT, prec);
+    }
+    
+    
     float lrate;
+    int act;
+    int prec;
     
-    Matrix<float, INPUT, HIDDEN> *pwih;
+    Matrix<float, INPUT, HIDDEN, RowMajor> *pwih;
     Matrix<float, HIDDEN, OUTPUT> *pwho;
+    // hih has HALF_PAD values of padding for the sparse kernels
+    std::vector<uint16_t> hih;
+    std::vector<uint16_t> hho;
     
-    Array<float, Dynamic, HIDDEN> *ph1;
-    Array<float, Dynamic, OUTPUT> *po1;
+    workspace *pws;
 };
+
+#endif